@@ -0,0 +1,259 @@
+// board description: the mcu, which pin does what, and the features the board has.
+// pick the board with BOARD_REV (or define it in the project), the mcu comes from the
+// chip set in the project. everything here is resolved by the preprocessor, the pin
+// macros end up as single sbi/cbi/sbis style instructions.
+
+#ifndef _BOARD_INCLUDED_
+#define _BOARD_INCLUDED_
+
+// 1: the first board, 2: the second revision, its keypad connector is mirrored
+#ifndef BOARD_REV
+#define BOARD_REV 1
+#endif
+
+
+// mcu -------------------------------------------------------------------------------------
+
+// CodeVision names the chip _CHIP_ATMEGAxx_, avr-gcc __AVR_ATmegaxx__ (from -mmcu)
+#if defined(_CHIP_ATMEGA644_) || defined(_CHIP_ATMEGA644P_) || defined(_CHIP_ATMEGA644PA_) || \
+    defined(__AVR_ATmega644__) || defined(__AVR_ATmega644P__) || defined(__AVR_ATmega644PA__)
+#define MCU_MEGA644
+#elif defined(_CHIP_ATMEGA328_) || defined(_CHIP_ATMEGA328P_) || defined(__AVR_ATmega328__) || defined(__AVR_ATmega328P__)
+#define MCU_MEGA328
+#else
+#define MCU_MEGA32
+#endif
+
+#ifndef __CODEVISIONAVR__
+#include <avr/io.h>
+#elif defined(MCU_MEGA644)
+#include <mega644.h>
+#elif defined(MCU_MEGA328)
+#include <mega328p.h>
+#else
+#include <mega32.h>
+#endif
+
+#ifdef MCU_MEGA32
+// the code is written against the mega32 names, the newer parts map onto them below
+#define TIMSK0 TIMSK // one register for all the timers: set them with |=, not =
+#define TIMSK1 TIMSK
+#define TIMSK2 TIMSK
+#define SLEEP_CONTROL MCUCR
+#define BANDGAP_MV 1220
+
+// Timer0: normal mode, clk/64. Timer2: CTC top=OCR2, clk/64
+#define TIMER0_CLK64() TCCR0=(0<<WGM00) | (0<<COM01) | (0<<COM00) | (0<<WGM01) | (0<<CS02) | (1<<CS01) | (1<<CS00)
+#define TIMER2_CTC_CLK64() TCCR2=(0<<WGM20) | (0<<COM21) | (0<<COM20) | (1<<WGM21) | (1<<CS22) | (0<<CS21) | (0<<CS20)
+// INT0, INT1: falling edge. INT2 is set to the falling edge by ISC2 = 0 in MCUCSR
+#define EXT_INT_FALLING() MCUCR=(1<<ISC11) | (0<<ISC10) | (1<<ISC01) | (0<<ISC00)
+// usart, transmitter only: 8N1
+#define UART_TX_ON(ubrr) do { UBRRH=(ubrr) >> 8; UBRRL=(ubrr) & 0xFF; UCSRC=(1<<URSEL) | (1<<UCSZ1) | (1<<UCSZ0); UCSRB=(1<<TXEN); } while (0)
+#define UART_TX_OFF() UCSRB=0
+#define UART_TX_READY() (UCSRA & (1<<UDRE))
+#define UART_DATA UDR
+#else
+#define GICR EIMSK
+#define GIFR EIFR
+#define MCUCSR MCUSR
+#define WDTCR WDTCSR
+#define WDTOE WDCE
+#define OCR0 OCR0A
+#define OCR2 OCR2A
+#define OCIE0 OCIE0A
+#define OCIE2 OCIE2A
+#define TICIE1 ICIE1
+#define SFIOR ADCSRB
+#define SLEEP_CONTROL SMCR
+#define TIM0_COMP TIM0_COMPA
+#define TIM2_COMP TIM2_COMPA
+#define BANDGAP_MV 1100
+
+#define TIMER0_CLK64() do { TCCR0A=0x00; TCCR0B=(1<<CS01) | (1<<CS00); } while (0)
+#define TIMER2_CTC_CLK64() do { TCCR2A=(1<<WGM21); TCCR2B=(1<<CS22); } while (0)
+#define EXT_INT_FALLING() EICRA=(1<<ISC21) | (1<<ISC11) | (1<<ISC01)
+#define UART_TX_ON(ubrr) do { UBRR0H=(ubrr) >> 8; UBRR0L=(ubrr) & 0xFF; UCSR0C=(1<<UCSZ01) | (1<<UCSZ00); UCSR0B=(1<<TXEN0); } while (0)
+#define UART_TX_OFF() UCSR0B=0
+#define UART_TX_READY() (UCSR0A & (1<<UDRE0))
+#define UART_DATA UDR0
+#endif
+
+#ifdef MCU_MEGA328
+#error "BOARD_REV 1 and 2 need PORTA and INT2, a 28 pin board needs its own pin map below"
+#endif
+
+// internal bandgap as an adc input, read against AREF (tied to VCC) it gives the supply
+#define ADC_BANDGAP 0x1E
+
+
+// pins ------------------------------------------------------------------------------------
+
+#define BIT_SET(port, bit) ((port) |= (1<<(bit)))
+#define BIT_CLEAR(port, bit) ((port) &= ~(1<<(bit)))
+#define BIT_IS_CLEAR(pin, bit) (!((pin) & (1<<(bit))))
+
+// alphanumeric lcd, 4 bit: D4-D7 on C.0-C.3, RS C.4, EN C.5.
+// CodeVision's alcd takes the port from the project (Configure|C Compiler|Libraries),
+// keep it the same as here.
+#define LCD_PORT PORTC
+#define LCD_DDR DDRC
+#define LCD_D4 0 // D5-D7 on the next three bits
+#define LCD_RS 4
+#define LCD_EN 5
+#define LCD_COLUMNS 16
+
+// 7 segments: the segment data on PORTA, a common cathode digit lights with a 1
+#define SEG_PORT PORTA
+#define SEG_FONT {0x3F, 0x06, 0x5B, 0x4F, 0x66, 0x6D, 0x7D, 0x07, 0x7F, 0x6F}
+
+// the pair of digits is picked by D.0/D.1 on the ORs decoder, the digit in the pair by
+// D.4 (left) or D.5 (right). the leds decoder shares D.0/D.1 and latches on a C.6 pulse.
+#define DIGIT_PORT PORTD
+#define DIGIT_ADDR_SHIFT 0
+#define DIGIT_ADDR_MASK 0x03
+#define DIGIT_LEFT 4
+#define DIGIT_RIGHT 5
+#define DIGIT_SELECT(pair, right) DIGIT_PORT = (DIGIT_PORT & ~(DIGIT_ADDR_MASK | (1<<DIGIT_LEFT) | (1<<DIGIT_RIGHT))) | \
+                                  ((right) ? (1<<DIGIT_RIGHT) : (1<<DIGIT_LEFT)) | ((pair) << DIGIT_ADDR_SHIFT)
+#define LED_SELECT(code) DIGIT_PORT = (DIGIT_PORT & ~DIGIT_ADDR_MASK) | ((code) << DIGIT_ADDR_SHIFT)
+
+#define DECODER_PORT PORTC
+#define SEVENS_ENABLE 7 // ORs decoder, active low
+#define LEDS_LATCH 6 // leds (and NANDs) decoder, active low
+#define SEVENS_OFF() BIT_SET(DECODER_PORT, SEVENS_ENABLE)
+#define SEVENS_ON() BIT_CLEAR(DECODER_PORT, SEVENS_ENABLE)
+#define LEDS_LATCH_PULSE() do { BIT_CLEAR(DECODER_PORT, LEDS_LATCH); BIT_SET(DECODER_PORT, LEDS_LATCH); } while (0)
+
+#define BUZZER_PORT PORTD
+#define BUZZER_BIT 6
+#define BUZZER_ON() BIT_SET(BUZZER_PORT, BUZZER_BIT)
+#define BUZZER_OFF() BIT_CLEAR(BUZZER_PORT, BUZZER_BIT)
+
+// thermostat relay or ssr, D.7, high to switch it on
+#define RELAY_PORT PORTD
+#define RELAY_BIT 7
+#define RELAY_ON() BIT_SET(RELAY_PORT, RELAY_BIT)
+#define RELAY_OFF() BIT_CLEAR(RELAY_PORT, RELAY_BIT)
+
+// the setting buttons: INT0 (D.2) temperature, INT1 (D.3) time/alarm, INT2 (B.2) date, all
+// pulled up and low when pressed. the bootloader stays in when the time/alarm one is held at reset
+#define BOOT_BUTTON_PORT PORTD
+#define BOOT_BUTTON_PIN PIND
+#define BOOT_BUTTON_BIT 3
+
+// ICP1 for the pps or the rtc square wave input, D.6 on the 40 pin parts: the buzzer pin
+#define ICP_PORT PORTD
+#define ICP_BIT 6
+
+// 4x3 keypad: a row is pulled low and the columns are read, with their pull-ups
+#define KEY_ROW_PORT PORTB
+#define KEY_COL_PIN PINB
+#if BOARD_REV == 2
+#define KEY_ROW0 7
+#define KEY_ROW1 6
+#define KEY_ROW2 5
+#define KEY_ROW3 4
+#define KEY_COL0 3
+#define KEY_COL1 1
+#define KEY_COL2 0
+#else
+#define KEY_ROW0 4
+#define KEY_ROW1 5
+#define KEY_ROW2 6
+#define KEY_ROW3 7
+#define KEY_COL0 0
+#define KEY_COL1 1
+#define KEY_COL2 3
+#endif
+
+// AIN1 of the analog comparator, B.3: a keypad column on both boards
+#define AIN1_BIT 3
+
+// port directions and pull-ups at reset. A.0-A.6: segments, A.7: temperature sensor input.
+// B.0-B.3: keypad columns (B.2: INT2), B.4-B.7: rows.
+// D.0/D.1 decoder address, D.2/D.3 INT0/INT1, D.4/D.5 digit select, D.6 buzzer, D.7 relay
+#define PORTA_DDR_INIT 0b01111111
+#define PORTB_DDR_INIT 0b11110000
+#define PORTC_DDR_INIT 0xFF
+#define PORTD_DDR_INIT 0b11110011
+#define PORTB_INIT 0xFF
+#define PORTD_INIT 0b00111111 // pull-ups on the buttons, buzzer and relay off
+
+
+// features --------------------------------------------------------------------------------
+
+// temperature sensor on ADC7 (A.7)
+#define TEMPER_ADC_CHANNEL 7
+
+// temperature sensor profiles, pick the one on the board with TEMPER_SENSOR
+#define SENSOR_LM35 0 // 10mV/C from 0C
+#define SENSOR_NTC_10K 1 // 10k B3950 thermistor to ground, 10k pull up to AREF
+#define SENSOR_OFFSET_500MV 2 // 10mV/C with 500mV at 0C: lm35 on an offset front end, or a TMP36
+#define TEMPER_SENSOR SENSOR_LM35
+
+// light sensor (ldr divider) on a spare adc input, for boards that have one.
+// A.0-A.6 are the segments and A.7 the temperature, so it's off here.
+// #define LIGHT_SENSOR_CHANNEL 6
+
+// a second temperature sensor (same profile as the indoor one) on a spare adc input
+// #define OUTDOOR_ADC_CHANNEL 5
+
+// power fail detection. with POWER_FAIL_COMPARATOR the analog comparator watches a divider
+// ahead of the regulator on AIN1 against the bandgap (the keypad column has to move).
+// without it the scanner's supply reading is checked, which only sees the drop once the
+// regulator falls out and only every SCAN_CHANNELS * SCAN_PERIOD_MS: the snapshot is
+// best effort then and mostly comes too late, see the README.
+// #define POWER_FAIL_COMPARATOR
+
+// 1 PPS reference (gps module or similar) on ICP1, the buzzer has to move.
+// the pulse is timestamped by the input capture and the second is steered onto it.
+// #define PPS_INPUT
+
+// external rtc on the twi, it keeps the time over power cuts. its 1Hz square wave output
+// goes to ICP1 (like the pps input) and gives the second instead of timer1's compare.
+// the twi is C.0/C.1, the lcd data lines, so the lcd has to move.
+#define RTC_DS1307 1
+#define RTC_DS3231 2
+// #define RTC_CHIP RTC_DS1307
+
+#if defined(RTC_CHIP) && defined(PPS_INPUT)
+#error "the rtc square wave and the pps input both need ICP1"
+#endif
+
+// thermostat: the relay on D.7 holds the temperature at the middle of the min/max band.
+// THERMO_PID runs a pid and turns its output into on time within a fixed window,
+// THERMO_HYSTERESIS switches at half a degree either side. both keep the relay's minimum
+// on and off times. THERMO_COOLING for a cooler on the relay instead of a heater.
+#define THERMO_PID 1
+#define THERMO_HYSTERESIS 2
+// #define THERMOSTAT THERMO_PID
+// #define THERMO_COOLING
+
+// temperature bands by time of day and weekday (temper_schedule in code.c): each band
+// sets min and max when it starts, a band set by hand holds until the next one starts
+// #define TEMPER_SCHEDULE
+
+// daylight saving: the rule from the table in code.c the clock follows, it moves its hour at
+// the changes by itself. Iran's rule is kept for the years it was in force (to 1401)
+#define DST_NONE 0
+#define DST_IRAN 1
+#define DST_RULE DST_NONE
+
+// input trace, for bugs that depend on when the keys and buttons come.
+// TRACE_RECORD keeps the keypad events and the button edges with their times in ram, key 3
+// on the main screen sends them out of the usart (9600 8N1). TXD is D.1, a digit address
+// line, so the 7 segments are garbled while it sends.
+// TRACE_REPLAY builds in a recorded trace (trace_data.h, made by tools/trace.py) and feeds
+// it in at the same ticks instead of the keypad and the buttons. when it has run out it
+// sends the lcd, 7 segments and clock state and the busy cycles, to diff against a golden run.
+// #define TRACE_RECORD
+// #define TRACE_REPLAY
+
+#if defined(TRACE_RECORD) && defined(TRACE_REPLAY)
+#error "a build either records a trace or replays one"
+#endif
+#if defined(TRACE_REPLAY) && (defined(PPS_INPUT) || defined(RTC_CHIP))
+#error "a replay runs on timer1's own seconds, an outside reference would make it differ run to run"
+#endif
+
+#endif
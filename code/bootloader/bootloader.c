@@ -0,0 +1,231 @@
+// serial bootloader. it sits in the boot section and runs first on every reset (BOOTRST
+// programmed). with a verified image in flash and the time/alarm button up it jumps to the
+// clock straight away; otherwise it takes a new image over the usart, see tools/flash.py.
+// avr-gcc only, build it with the Makefile next to this file.
+//
+// the protocol, all numbers little endian, crc is crc-16/xmodem:
+//   'I'                                   -> 'I' version pagesize(2) app_end(2)
+//   'W' page(2) data[pagesize] crc(2)     -> 'K' page(2), or 'N' page(2) if the crc or page is bad
+//   'V' length(2) crc(2)                  -> 'K' when flash [0, length) has that crc, else 'N'
+//   'G'                                   -> 'K', then the application starts
+// a block is acknowledged before it's programmed and the usart is read while the flash is
+// busy, so the host can keep two blocks in flight and the programming time is hidden.
+// after a 'N' everything is dropped until the line has been quiet for IDLE_MS.
+
+#include "../board.h"
+#include <avr/boot.h>
+#include <avr/eeprom.h>
+#include <avr/pgmspace.h>
+#include <util/crc16.h>
+#include <util/delay.h>
+
+#define BOOT_VERSION 1
+
+#ifndef BOOT_BAUD
+#define BOOT_BAUD 38400
+#endif
+#define BOOT_UBRR ((F_CPU + 4UL * BOOT_BAUD) / (8UL * BOOT_BAUD) - 1) // double speed
+
+#ifndef BOOT_START
+#error "BOOT_START: the byte address of the boot section, from the Makefile"
+#endif
+#define APP_END BOOT_START
+
+// last eeprom byte: IMAGE_VALID once an image has been verified, anything else keeps the
+// bootloader in. the clock's own eeprom variables are at the start
+#define IMAGE_FLAG ((uint8_t *)E2END)
+#define IMAGE_VALID 0x5A
+
+#define RX_SIZE 512 // two blocks in flight, must be a power of two
+#define IDLE_MS 20
+
+#ifdef MCU_MEGA32
+#define UART_STATUS UCSRA
+#define UART_CONTROL UCSRB
+#define UART_DATA_REG UDR
+#define UART_RX_DONE RXC
+#define UART_TX_EMPTY UDRE
+#define UART_START() do { UBRRH=BOOT_UBRR >> 8; UBRRL=BOOT_UBRR & 0xFF; UCSRA=(1<<U2X); \
+                     UCSRC=(1<<URSEL) | (1<<UCSZ1) | (1<<UCSZ0); UCSRB=(1<<RXEN) | (1<<TXEN); } while (0)
+#else
+#define UART_STATUS UCSR0A
+#define UART_CONTROL UCSR0B
+#define UART_DATA_REG UDR0
+#define UART_RX_DONE RXC0
+#define UART_TX_EMPTY UDRE0
+#define UART_START() do { UBRR0H=BOOT_UBRR >> 8; UBRR0L=BOOT_UBRR & 0xFF; UCSR0A=(1<<U2X0); \
+                     UCSR0C=(1<<UCSZ01) | (1<<UCSZ00); UCSR0B=(1<<RXEN0) | (1<<TXEN0); } while (0)
+#endif
+
+// no global variables: the startup code would clear them, and the ram below the stack still
+// holds the clock's warm restart copy when the bootloader only passes through
+struct Rx {
+    uint8_t buf[RX_SIZE];
+    uint16_t head;
+    uint16_t tail;
+};
+
+static void rx_poll(struct Rx *rx) {
+    if (UART_STATUS & (1<<UART_RX_DONE)) {
+        rx->buf[rx->head] = UART_DATA_REG;
+        rx->head = (rx->head + 1) & (RX_SIZE - 1);
+    }
+}
+
+static uint8_t rx_get(struct Rx *rx) {
+    uint8_t c;
+
+    while (rx->head == rx->tail)
+        rx_poll(rx);
+    c = rx->buf[rx->tail];
+    rx->tail = (rx->tail + 1) & (RX_SIZE - 1);
+
+    return c;
+}
+
+static uint16_t rx_get_word(struct Rx *rx, uint16_t *crc) {
+    uint8_t lo = rx_get(rx);
+    uint8_t hi = rx_get(rx);
+
+    if (crc) {
+        *crc = _crc_xmodem_update(*crc, lo);
+        *crc = _crc_xmodem_update(*crc, hi);
+    }
+    return lo | (hi << 8);
+}
+
+static void rx_drain(struct Rx *rx) {
+    // drops whatever comes until the line is quiet
+    uint16_t quiet = 0;
+
+    while (quiet < IDLE_MS * 10) {
+        if (rx->head != rx->tail) {
+            rx->tail = rx->head;
+            quiet = 0;
+        }
+        _delay_us(100);
+        rx_poll(rx);
+        quiet++;
+    }
+}
+
+static void tx_put(struct Rx *rx, uint8_t c) {
+    while (!(UART_STATUS & (1<<UART_TX_EMPTY)))
+        rx_poll(rx);
+    UART_DATA_REG = c;
+}
+
+static void tx_reply(struct Rx *rx, uint8_t c, uint16_t page) {
+    tx_put(rx, c);
+    tx_put(rx, page & 0xFF);
+    tx_put(rx, page >> 8);
+}
+
+static void spm_wait(struct Rx *rx) {
+    // the boot section keeps running while the application section is written
+    while (boot_spm_busy())
+        rx_poll(rx);
+}
+
+static void write_page(struct Rx *rx, uint32_t address, uint8_t *data) {
+    uint16_t i;
+
+    while (!eeprom_is_ready()) // spm can't start while an eeprom write is going on
+        rx_poll(rx);
+    boot_page_erase(address);
+    spm_wait(rx);
+    for (i = 0; i < SPM_PAGESIZE; i += 2)
+        boot_page_fill(address + i, data[i] | (data[i + 1] << 8));
+    boot_page_write(address);
+    spm_wait(rx);
+    boot_rww_enable();
+}
+
+static uint16_t flash_crc(uint16_t length) {
+    uint16_t crc = 0;
+    uint16_t i;
+
+    for (i = 0; i < length; i++)
+        crc = _crc_xmodem_update(crc, pgm_read_byte(i));
+
+    return crc;
+}
+
+static void start_app(void) {
+    __asm__ __volatile__ ("jmp 0");
+}
+
+int main(void) {
+    struct Rx rx;
+    uint8_t data[SPM_PAGESIZE];
+    uint16_t page, length, crc, i;
+    uint8_t command;
+
+    // fast path: a few microseconds from reset to the clock. the reset flags are left for
+    // the clock, it tells a warm restart by them
+    BIT_SET(BOOT_BUTTON_PORT, BOOT_BUTTON_BIT);
+    _delay_us(20); // the pull-up charging the pin
+    if (!BIT_IS_CLEAR(BOOT_BUTTON_PIN, BOOT_BUTTON_BIT) && eeprom_read_byte(IMAGE_FLAG) == IMAGE_VALID) {
+        BOOT_BUTTON_PORT = 0x00; // as the reset left it
+        start_app();
+    }
+
+#ifndef MCU_MEGA32
+    MCUSR &= ~(1<<WDRF); // the newer parts keep the watchdog on after it reset them
+#endif
+    WDTCR = (1<<WDTOE) | (1<<WDE);
+    WDTCR = 0x00;
+
+    rx.head = 0;
+    rx.tail = 0;
+    UART_START();
+
+    while (1) {
+        command = rx_get(&rx);
+
+        if (command == 'I') {
+            tx_put(&rx, 'I');
+            tx_put(&rx, BOOT_VERSION);
+            tx_put(&rx, SPM_PAGESIZE & 0xFF);
+            tx_put(&rx, SPM_PAGESIZE >> 8);
+            tx_put(&rx, APP_END & 0xFF);
+            tx_put(&rx, APP_END >> 8);
+        }
+        else if (command == 'W') {
+            crc = 0;
+            page = rx_get_word(&rx, &crc);
+            for (i = 0; i < SPM_PAGESIZE; i++) {
+                data[i] = rx_get(&rx);
+                crc = _crc_xmodem_update(crc, data[i]);
+            }
+            if (rx_get_word(&rx, 0) != crc || (uint32_t)page * SPM_PAGESIZE >= APP_END) {
+                rx_drain(&rx); // the host sends again from this page
+                tx_reply(&rx, 'N', page);
+                continue;
+            }
+            tx_reply(&rx, 'K', page);
+            eeprom_update_byte(IMAGE_FLAG, 0xFF); // half written, stay in the bootloader
+            write_page(&rx, (uint32_t)page * SPM_PAGESIZE, data);
+        }
+        else if (command == 'V') {
+            length = rx_get_word(&rx, 0);
+            crc = rx_get_word(&rx, 0);
+            if (length <= APP_END && flash_crc(length) == crc) {
+                eeprom_update_byte(IMAGE_FLAG, IMAGE_VALID);
+                tx_put(&rx, 'K');
+            }
+            else
+                tx_put(&rx, 'N');
+        }
+        else if (command == 'G') {
+            tx_put(&rx, 'K');
+            while (!(UART_STATUS & (1<<UART_TX_EMPTY)));
+            _delay_ms(2); // the last byte leaving the shift register
+            UART_CONTROL = 0x00;
+            BOOT_BUTTON_PORT = 0x00;
+            MCUCSR = 0x00; // a cold start for the new image, the warm restart copy is the old one's
+            start_app();
+        }
+        // anything else is noise on the line
+    }
+}
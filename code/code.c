@@ -1,9 +1,8 @@
 // when you press interrupt keys for a setting, you must enter the 4 digit pin correctly (you can change the global variable "pin")
 
-#include <mega32.h>
-#include <alcd.h>
+#include "board.h" // the mcu header comes in through it
+#include "compat.h" // CodeVision or avr-gcc
 #include <stdbool.h>
-#include <delay.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -14,30 +13,298 @@
 
 #define USER_BLOCK_MAX_TIME 15
 
+#define CAL_MIN_SPAN 20 // 2C between the two calibration points, closer ones only shift the reading
+
+#define TREND_INTERVAL 30 // seconds (sensor_task runs) between two trend samples
+#define TREND_SMOOTH 3 // each sample moves the trend by 1/8
+#define TREND_STEADY 5 // 0.01C/min, slower than this shows as steady
+#define TREND_WARN_MINUTES 10 // warn when the trend crosses min/max within this, 0: no warning
+
+#define WARM_MAGIC 0x5AC3 // the warm restart copy is NOINIT (see compat.h), the checksum catches a cleared one
+
+// power fail detection, see POWER_FAIL_COMPARATOR in board.h
+#define POWER_FAIL_MV 4300 // keep it above the brown-out level
+#define POWER_FAIL_BANDGAP ((unsigned long)BANDGAP_MV * 1024 / POWER_FAIL_MV) // bandgap reading at POWER_FAIL_MV
+
+// eeprom slots the snapshot rotates through, the one for the next power fail is cleared at boot
+#define SNAPSHOT_SLOTS 8
+#define SNAPSHOT_BYTES 8
+#define SNAPSHOT_EMPTY 0xFF
+#define SNAPSHOT_YEAR_BASE 1400
+#define YEAR_MAX (SNAPSHOT_YEAR_BASE + 127) // the snapshot keeps the year in 7 bits
+
+#define LCD_CHAR_RISING 1 // custom lcd characters, 0 can't be used in a string
+#define LCD_CHAR_FALLING 2
+
 #define KEYPAD_SQUARE 11
 #define KEYPAD_STAR 10
 
+#define KEYPAD_DEBOUNCE_MS 20
+#define KEYPAD_SCAN_MS 4
+#define BUTTON_LOCKOUT_MS 250
+
+#define EVENT_QUEUE_SIZE 8 // must be a power of two
+#define EVENT_KEY 0
+#define EVENT_BUTTON_TEMPER 1
+#define EVENT_BUTTON_TIME 2
+#define EVENT_BUTTON_DATE 3
+
+// input trace, see TRACE_RECORD / TRACE_REPLAY in board.h. a record is the ms since the one
+// before (1 byte under 128, else 2 with the top bit set) and a byte of (type << 4) | key,
+// the type is an EVENT_ one or TRACE_GAP, which only carries time
+#define TRACE_SIZE 256 // ram kept for a recording, it stops when it's full
+#define TRACE_VERSION 1
+#define TRACE_HEADER_SIZE 16 // 'T', version, the clock and settings the trace starts from
+#define TRACE_GAP 15
+#define TRACE_GAP_MAX 0x7FFF
+#define TRACE_SETTLE_MS 3000 // the replay is reported this long after its last record
+#define TRACE_UBRR 51 // 9600 baud at 8MHz
+
+// sleep modes, as the SM2..SM0 bits of SLEEP_CONTROL
+#define SLEEP_IDLE 0
+#define TIMER2_COUNTS_PER_MS 125 // timer2 counts at 125kHz, 8us each
+#define ADC_CONVERSION_US 26 // 13 adc clocks at 500kHz
+#define BANDGAP_SETTLE_US 100 // start-up of the bandgap reference after the mux switches to it
+
+#define TIMER0_START 0x0F // each digit gets the 241 timer0 counts from here to the overflow
+#define BRIGHTNESS_LEVELS 8
+
+// holiday and reminder calendar: a 16 bit entry is month (4 bits), day (5) and text (7)
+// from the top, so sorting the entries sorts them by date
+#define CALENDAR_KEY(month, day) (((month) << 5) | (day))
+#define CALENDAR_ENTRY(month, day, text) (((unsigned int)CALENDAR_KEY(month, day) << 7) | (text))
+#define CALENDAR_NONE 0
+
+#define CAL_NOWRUZ 1
+#define CAL_REPUBLIC_DAY 2
+#define CAL_NATURE_DAY 3
+#define CAL_KHOMEINI 4
+#define CAL_KHORDAD_15 5
+#define CAL_SCHOOLS 6
+#define CAL_YALDA 7
+#define CAL_REVOLUTION 8
+#define CAL_OIL_DAY 9
+
+// pages of the main screen's second line, see lcd_pages
+#define PAGE_RUNS 15 // display_task runs (3s) a page stays
+#define PAGE_HIDDEN 0xFFFFFFFF // from a page's source: nothing to show now
+#define PAGE_NONE 0xFF
+#define PAGE_ALARM 0
+
+#define LIGHT_HYSTERESIS 24 // adc steps past a threshold before the level changes
+
+// adc channels the scanner goes round, one conversion each SCAN_PERIOD_MS
+#define SCAN_PERIOD_MS 250
+
+#define SCAN_INDOOR 0
+#define SCAN_SUPPLY 1
+#ifdef OUTDOOR_ADC_CHANNEL
+#define SCAN_OUTDOOR 2
+#define SCAN_OPTIONAL 3
+#else
+#define SCAN_OPTIONAL 2
+#endif
+#ifdef LIGHT_SENSOR_CHANNEL
+#define SCAN_LIGHT SCAN_OPTIONAL
+#define SCAN_CHANNELS (SCAN_OPTIONAL + 1)
+#else
+#define SCAN_CHANNELS SCAN_OPTIONAL
+#endif
+
+// timer1 runs free at TIMER1_HZ and each second ends on its compare A
+#define TIMER1_HZ 31250 // 8MHz / 256
+#define CLOCK_PERIOD_NOMINAL ((unsigned long)TIMER1_HZ << 8) // one second in 1/256 timer1 counts
+
+// 1 PPS discipline, see PPS_INPUT in board.h
+#define PPS_STEP_COUNTS 3906 // offsets over 1/8s are stepped at once, smaller ones are slewed
+#define PPS_MAX_DEVIATION 300 // counts (1%) a pulse interval may be off before it's a glitch
+#define PPS_HOLDOVER_SECONDS 3 // without a pulse for longer, the learned rate is held
+#define PPS_SAVE_INTERVAL 3600 // seconds between two saves of the learned rate while locked
+#define PPS_NONE 0
+#define PPS_LOCKED 1
+#define PPS_HOLDOVER 2
+
+// external rtc, see RTC_CHIP in board.h
+#define RTC_ADDRESS 0xD0 // both chips
+#define RTC_RESYNC_SECONDS 3600 // the time is read back this often, in case a pulse was lost
+#define TWI_TIMEOUT 2000 // polls before a transfer is given up
+
+// thermostat, see THERMOSTAT in board.h. the error is in 0.1C and the output in 0.1% of the
+// window, the gains are x256
+#define THERMO_STEP_SECONDS 10 // thermostat_task runs between two control steps
+#define THERMO_WINDOW_SECONDS 100 // the relay is on for the first duty of each window
+#define THERMO_DUTY_MAX 1000
+#define THERMO_KP 5120 // 2% per 0.1C: full on 5C below the setpoint
+#define THERMO_KI 85 // integral time 600s
+#define THERMO_KD 30720 // derivative time 60s, on the temperature so a new setpoint doesn't kick
+#define THERMO_ERROR_MAX 500 // 50C, keeps the products in range
+#define THERMO_HYSTERESIS_X10 5
+#define THERMO_MIN_ON_SECONDS 10
+#define THERMO_MIN_OFF_SECONDS 10
+
+// temperature schedule, see TEMPER_SCHEDULE in board.h. the week starts on saturday
+#define DAY_SAT 0x01
+#define DAY_SUN 0x02
+#define DAY_MON 0x04
+#define DAY_TUE 0x08
+#define DAY_WED 0x10
+#define DAY_THU 0x20
+#define DAY_FRI 0x40
+#define DAYS_WORKWEEK (DAY_SAT | DAY_SUN | DAY_MON | DAY_TUE | DAY_WED)
+#define DAYS_WEEKEND (DAY_THU | DAY_FRI)
+#define DAYS_ALL 0x7F
+#define WEEKDAY_1400 1 // 1 Farvardin 1400 was a sunday
+#define SCHEDULE_NONE 0xFF
+
+// daylight saving, see DST_RULE in board.h
+#define DST_NEVER 0xFFFFFFFF // dst_next when no change is due this year
+#define SECONDS_PER_DAY 86400L
+
+// stopwatch and countdown, counted in 1/100s off the timer2 tick
+#define WATCH_OFF 0
+#define WATCH_STOPWATCH 1
+#define WATCH_COUNTDOWN 2
+#define WATCH_LAPS 8 // the last ones are kept
+#define WATCH_MAX_CS 35999999 // 99:59:59.99
+
+#define WHEEL_SLOTS 16 // must be a power of two
+
+
+struct ClockSnapshot;
 
 void init();
 
 void show_time();
-void show_number_on_sevens(int number[], char segment_num);
+void show_number_on_sevens(int number[], unsigned char segment_num, unsigned char part);
 
 void show_alarm(int x, int y);
+void format_alarm(char *out, struct ClockSnapshot *snap);
 void show_date_temp();
+void calendar_update();
+void page_update(struct ClockSnapshot *snap);
+void page_next(struct ClockSnapshot *snap);
+unsigned long alarm_page_source(struct ClockSnapshot *snap);
+void alarm_page_render(char *line, struct ClockSnapshot *snap);
+unsigned long calendar_page_source(struct ClockSnapshot *snap);
+void calendar_page_render(char *line, struct ClockSnapshot *snap);
+unsigned long countdown_page_source(struct ClockSnapshot *snap);
+void countdown_page_render(char *line, struct ClockSnapshot *snap);
+unsigned long today_page_source(struct ClockSnapshot *snap);
+void today_page_render(char *line, struct ClockSnapshot *snap);
+unsigned long uptime_page_source(struct ClockSnapshot *snap);
+void uptime_page_render(char *line, struct ClockSnapshot *snap);
+unsigned long lockout_page_source(struct ClockSnapshot *snap);
+void lockout_page_render(char *line, struct ClockSnapshot *snap);
 
 void set_temper_int();
 void set_time_alarm_int();
 void set_date_int();
 
 void update_temper();
+int sensor_to_temper(int adc);
+void temper_calibrate(int raw, int ref);
+void set_temper_cal();
+void format_x10(char *out, int value);
+void update_trend();
+void lcd_define_char(flash unsigned char *pattern, unsigned char code);
 void update_temper_led();
 void update_time_date();
+bool jalali_leap(int year);
+unsigned char jalali_month_days(int year, int month);
 
 void check_alarm();
 void time_alarm_get_input(bool);
 int login();
-int keypad();
+int keypad_scan();
+void keypad_update();
+void button_pressed(unsigned char type);
+
+unsigned int get_ticks();
+void scheduler_run();
+void input_task();
+void alert_task();
+void sensor_task();
+void display_task();
+void alarm_task();
+void power_task();
+void main_screen_key(int key);
+void watch_task();
+void watch_key(int key);
+void watch_start(unsigned char mode);
+bool watch_button(unsigned char type);
+void watch_digits(unsigned long cs, int digits[3][2]);
+void format_watch(char *out, unsigned long cs);
+void show_watch();
+void light_task();
+void scanner_task();
+#ifdef PPS_INPUT
+void pps_task();
+void show_pps_stats();
+#endif
+#ifdef THERMOSTAT
+void thermostat_task();
+void thermostat_step(int setpoint, int input);
+void show_thermostat();
+#endif
+void clock_second();
+#ifdef RTC_CHIP
+void rtc_task();
+void rtc_start();
+bool rtc_read_regs(unsigned char first, unsigned char *buf, unsigned char count);
+bool rtc_write_regs(unsigned char first, unsigned char *buf, unsigned char count);
+bool twi_start(unsigned char address);
+bool twi_write(unsigned char data);
+unsigned char twi_read(bool ack);
+void twi_stop();
+bool twi_wait();
+void gregorian_to_jalali(int gy, int gm, int gd, int *jy, int *jm, int *jd);
+void jalali_to_gregorian(int jy, int jm, int jd, int *gy, int *gm, int *gd);
+#endif
+unsigned int scan_value(unsigned char channel);
+unsigned int supply_mv();
+void set_brightness(unsigned char level);
+void show_power_stats();
+
+unsigned long power_stamp();
+unsigned int adc_convert();
+void power_sleep(unsigned char mode);
+
+void timer_wheel_run();
+void buzzer_beep(unsigned int ms);
+void buzzer_off();
+void hold_display(unsigned int ms);
+void ui_wait(unsigned int ms);
+int ui_get_key();
+void pad_line(char *line);
+void button_edge(unsigned char type);
+#if defined(TRACE_RECORD) || defined(TRACE_REPLAY)
+void trace_start();
+void trace_tick();
+void uart_start();
+void uart_stop();
+void uart_putchar(char c);
+void uart_puts(char *str);
+void uart_hex(unsigned char value);
+#endif
+#ifdef TRACE_RECORD
+void trace_put(unsigned char type, signed char key);
+void trace_dump();
+#endif
+#ifdef TRACE_REPLAY
+unsigned int trace_next_delta();
+void trace_task();
+void trace_report();
+void trace_lcd_clear();
+void trace_lcd_gotoxy(unsigned char x, unsigned char y);
+void trace_lcd_putchar(char c);
+void trace_lcd_puts(char *str);
+
+// the lcd calls go through a copy of the screen the replay report is made from
+#define lcd_clear() trace_lcd_clear()
+#define lcd_gotoxy(x, y) trace_lcd_gotoxy(x, y)
+#define lcd_putchar(c) trace_lcd_putchar(c)
+#define lcd_puts(str) trace_lcd_puts(str)
+#endif
 
 struct Time {
     int hour[2];
@@ -55,80 +322,624 @@ struct Temper {
     int min;
     int max;
     int current;
-    bool negative;
+    int current_x10; // 0.1C, calibrated
+    int raw_x10; // 0.1C, straight from the sensor table
+    int trend; // 0.01C/min
 } temper;
 
+// trend of the temperature: a smoothed per minute difference, updated once per sample, so
+// it costs the same on every sample and never looks back at old readings
+int trend_acc = 0; // 0.01C/min << TREND_SMOOTH
+int trend_last_x10 = 0;
+unsigned char trend_count = 0;
+bool trend_primed = false;
+bool trend_warning = false; // min/max will be crossed within TREND_WARN_MINUTES
+bool trend_warned = false;
+
+#ifdef THERMOSTAT
+// thermostat_task owns these. thermo_setpoint is 0.1C, -1 before the first step
+int thermo_setpoint = -1;
+int thermo_duty = 0; // 0.1% of THERMO_WINDOW_SECONDS
+long thermo_integral = 0; // x256, held in 0..THERMO_DUTY_MAX so it can't wind up
+int thermo_last_x10 = 0;
+unsigned char thermo_step_wait = 0;
+unsigned char thermo_window = 0; // seconds into the window
+unsigned int thermo_relay_seconds = 0; // since the relay last switched
+bool thermo_relay = false;
+#endif
+
+flash unsigned char lcd_char_rising[8] = {0x04, 0x0E, 0x15, 0x04, 0x04, 0x04, 0x04, 0x00};
+flash unsigned char lcd_char_falling[8] = {0x04, 0x04, 0x04, 0x04, 0x15, 0x0E, 0x04, 0x00};
+
+// piecewise linear sensor curve in flash, sorted by adc. the points are worked out offline
+// from the sensor's datasheet curve (for the ntc: Beta equation, the same as a Steinhart-Hart
+// fit over this range), so reading a temperature is a binary search and one interpolation.
+struct SensorPoint {
+    int adc;
+    int temper; // 0.1C
+};
+
+#if TEMPER_SENSOR == SENSOR_NTC_10K
+// R = 10k * exp(3950 * (1/T - 1/298.15)), adc = 1023 * R / (R + 10k), -20C to 100C every 5C
+flash struct SensorPoint sensor_table[] = {
+    {67, 1000}, {76, 950}, {87, 900}, {100, 850}, {115, 800}, {133, 750}, {153, 700},
+    {177, 650}, {204, 600}, {235, 550}, {270, 500}, {310, 450}, {354, 400}, {403, 350},
+    {456, 300}, {512, 250}, {569, 200}, {627, 150}, {684, 100}, {738, 50}, {788, 0},
+    {834, -50}, {873, -100}, {907, -150}, {934, -200}
+};
+#elif TEMPER_SENSOR == SENSOR_OFFSET_500MV
+// 5V AREF: 4.883mV a step, -40C is 100mV and 125C is 1750mV
+flash struct SensorPoint sensor_table[] = {{20, -400}, {358, 1250}};
+#else
+// 5V AREF: 4.883mV a step, 10mV/C
+flash struct SensorPoint sensor_table[] = {{0, 0}, {1023, 4995}};
+#endif
+
+#define SENSOR_TABLE_SIZE (sizeof(sensor_table) / sizeof(sensor_table[0]))
+
+// two point user calibration: corrected = raw * cal_gain / 256 + cal_offset
+int cal_gain = 256;
+int cal_offset = 0; // 0.1C
+int cal_raw[2];
+int cal_ref[2];
+unsigned char cal_points = 0;
+
 struct Alarm {
     bool on;
     struct Time atime;
 } alarm;
 
 
-char seg_numbers[] = {0x3F, 0x06, 0x5B, 0x4F, 0x66, 0x6D, 0x7D, 0x07, 0x7F, 0x6F}; // 7 segments are common cathod
-
-volatile bool temper_int = false;
-volatile bool time_int = false;
-volatile bool date_int = false;
+flash unsigned char seg_numbers[10] = SEG_FONT;
+
+// the fixed solar holidays and yearly reminders, sorted by date (more than one on a day: the
+// first is shown). the lunar holidays move every year and aren't in here
+flash unsigned int calendar[] = {
+    CALENDAR_ENTRY(1, 1, CAL_NOWRUZ),
+    CALENDAR_ENTRY(1, 2, CAL_NOWRUZ),
+    CALENDAR_ENTRY(1, 3, CAL_NOWRUZ),
+    CALENDAR_ENTRY(1, 4, CAL_NOWRUZ),
+    CALENDAR_ENTRY(1, 12, CAL_REPUBLIC_DAY),
+    CALENDAR_ENTRY(1, 13, CAL_NATURE_DAY),
+    CALENDAR_ENTRY(3, 14, CAL_KHOMEINI),
+    CALENDAR_ENTRY(3, 15, CAL_KHORDAD_15),
+    CALENDAR_ENTRY(7, 1, CAL_SCHOOLS),
+    CALENDAR_ENTRY(9, 30, CAL_YALDA),
+    CALENDAR_ENTRY(11, 22, CAL_REVOLUTION),
+    CALENDAR_ENTRY(12, 29, CAL_OIL_DAY)
+};
+
+#define CALENDAR_SIZE (sizeof(calendar) / sizeof(calendar[0]))
+
+// by CAL_ number, at most 16 characters
+flash char calendar_texts[][17] = {
+    "",
+    "Nowruz",
+    "Islamic Rep. Day",
+    "Nature Day",
+    "Khomeini's death",
+    "15 Khordad",
+    "Schools open",
+    "Yalda night",
+    "Revolution Day",
+    "Oil nationalized"
+};
+
+int calendar_key = -1; // date calendar_text was looked up for
+unsigned char calendar_text = CALENDAR_NONE; // today's entry
+
+// the second line takes turns between the pages. a page's source is a number that changes
+// whenever its line would, so the line is only formatted again when the source moved, and
+// only written to the lcd when it's new or another page was on the line
+struct LcdPage {
+    unsigned long (*source)(struct ClockSnapshot *snap); // PAGE_HIDDEN to be skipped
+    void (*render)(char *line, struct ClockSnapshot *snap);
+};
+
+flash struct LcdPage lcd_pages[] = {
+    {alarm_page_source,     alarm_page_render}, // PAGE_ALARM, always there
+    {calendar_page_source,  calendar_page_render},
+    {countdown_page_source, countdown_page_render},
+    {today_page_source,     today_page_render},
+    {uptime_page_source,    uptime_page_render},
+    {lockout_page_source,   lockout_page_render}
+};
+
+#define PAGE_COUNT (sizeof(lcd_pages) / sizeof(lcd_pages[0]))
+
+char page_lines[PAGE_COUNT][17];
+unsigned long page_sources[PAGE_COUNT];
+unsigned char page_rendered = 0; // bit per page, set once its line has been formatted
+unsigned char page_current = PAGE_ALARM;
+unsigned char page_shown = PAGE_NONE; // page on the lcd, PAGE_NONE after something else wrote there
+unsigned char page_runs = 0;
+
+// today's lowest and highest temperature, 0.1C
+int today_min_x10 = 0;
+int today_max_x10 = 0;
+int today_day = 0; // the day they're for, 0 before the first reading
+
+// keypad presses and setting buttons, in the order they happened. only isrs push
+// (and they don't nest), only the main loop pops, so the two indexes need no locking.
+struct Event {
+    unsigned char type;
+    signed char key; // for EVENT_KEY
+    unsigned int stamp; // sys_ticks when it happened
+};
+
+struct Event events[EVENT_QUEUE_SIZE];
+volatile unsigned char event_head = 0; // next free slot, written by the isrs
+volatile unsigned char event_tail = 0; // next event to serve, written by the main loop
+unsigned int events_dropped = 0;
+
+unsigned int button_accepted_at[3]; // sys_ticks of the last accepted press, per button
+
+int key_last_scan = -1;
+int key_stable = -1;
+unsigned int key_changed_at = 0;
+unsigned char key_scan_wait = 0;
+
+#ifdef TRACE_RECORD
+unsigned char trace_buf[TRACE_SIZE];
+unsigned int trace_len = 0;
+unsigned int trace_dropped = 0; // records that didn't fit
+unsigned int trace_gap = 0; // ms since the last record
+volatile unsigned char trace_seq = 0; // odd while an isr changes trace_len, like clock_seq
+#endif
+#ifdef TRACE_REPLAY
+flash unsigned char trace_data[] = {
+#include "trace_data.h"
+};
+unsigned int trace_pos = 0; // next record in trace_data
+unsigned int trace_wait = 0; // ms until it's due
+volatile bool trace_finished = false;
+bool trace_reported = false;
+unsigned long trace_ms = 0; // since the replay started
+volatile unsigned char trace_seq = 0; // odd while the timer2 isr changes trace_ms, like clock_seq
+char trace_lcd[2][LCD_COLUMNS + 1]; // what the lcd shows
+unsigned char trace_lcd_x = 0;
+unsigned char trace_lcd_y = 0;
+unsigned char trace_sevens[6]; // segment patterns last put on each digit
+unsigned int trace_invalid = 0; // seconds that ended with a bad time, date or limits
+#endif
 
 bool temper_buzz_alowed = false;
 bool alarm_buzz = false;
+volatile bool alarm_beep = false;
+
+unsigned char seven_digit = 0; // next digit show_time() lights, 0 to 5
+unsigned char brightness = BRIGHTNESS_LEVELS - 1;
+#ifdef LIGHT_SENSOR_CHANNEL
+bool brightness_auto = true; // follow the light sensor, until a level is picked by hand
+#else
+bool brightness_auto = false;
+#endif
+
+// timer0 counts a digit stays lit in each 241 count slot, per brightness level. the steps
+// grow with the level so they look even to the eye; the last one is full duty.
+flash unsigned char brightness_on_time[BRIGHTNESS_LEVELS] = {6, 12, 22, 36, 60, 95, 150, 240};
+
+#ifdef LIGHT_SENSOR_CHANNEL
+// light readings (0-1023) where the next brightness level starts
+flash int light_thresholds[BRIGHTNESS_LEVELS - 1] = {20, 45, 90, 160, 260, 400, 600};
+#endif
+volatile unsigned char led_code = 1; // temperature leds, the address for the leds decoder
+unsigned char led_latched = 0xFF;
 
 bool user_blocked = false;
 bool enable_login = true;
+bool menu_open = false;
+unsigned char menu_opened = 0; // counts menus opened, a task run that opened one waited on the user
+
+// stopwatch / countdown. the count runs in the timer2 isr and the buttons start and stop it
+// from their isrs, so neither depends on the main loop. watch_task turns the count into the
+// digits show_time() puts on the 7 segments while a mode is on; the clock keeps running.
+volatile unsigned char watch_mode = WATCH_OFF;
+volatile bool watch_running = false;
+volatile unsigned long watch_cs = 0; // 1/100s, counts down in the countdown
+volatile unsigned char watch_ms = 0; // timer2 ticks into the current 1/100s
+volatile unsigned long watch_laps[WATCH_LAPS]; // split times
+volatile unsigned char watch_lap_count = 0;
+volatile bool watch_done = false; // the countdown reached zero
+volatile unsigned char watch_seq = 0; // odd while an isr changes watch_cs or the laps, like clock_seq
+unsigned long watch_preset = 0;
+int watch_show[3][2]; // minutes, seconds, 1/100s (hours, minutes, seconds from an hour on)
 
 int buzz_numbers = 0;
 int user_block_time = 0;
 int pin = 1234;
 
+// time, date, temper limits, alarm time and the user block are owned by timer1_isr
+// (temper.current is written by sensor_task).
+// the main loop never writes them directly: it posts new values into "pending" and
+// the isr applies them on its next tick. readers take a copy with clock_snapshot(),
+// which retries while clock_seq shows that a tick happened during the copy.
+volatile unsigned char clock_seq = 0; // odd while timer1_isr is updating the state
+unsigned long uptime = 0; // seconds since reset, timer1_isr's
+
+struct Pending {
+    struct Time time;
+    struct Date date;
+    struct Time alarm_time;
+    int temper_min;
+    int temper_max;
+    int block_time;
+} pending;
+
+// one flag per item, so setting one never races with the isr clearing another
+volatile bool pending_time = false;
+volatile bool pending_date = false;
+volatile bool pending_alarm = false;
+volatile bool pending_temper = false;
+volatile bool pending_block = false;
+
+struct ClockSnapshot {
+    struct Time time;
+    struct Date date;
+    struct Temper temper;
+    struct Time alarm_time;
+    bool alarm_buzz;
+    bool user_blocked;
+    int user_block_time;
+    unsigned long uptime; // seconds
+};
+
+void apply_pending();
+void warm_save();
+bool warm_valid();
+void warm_restore();
+unsigned char warm_checksum();
+void power_fail();
+bool power_good();
+void snapshot_scan();
+void snapshot_save();
+bool snapshot_restore();
+bool snapshot_load(unsigned char index);
+void snapshot_put(unsigned char *buf, unsigned char *bit, unsigned int value, unsigned char width);
+unsigned int snapshot_get(unsigned char *buf, unsigned char *bit, unsigned char width);
+unsigned char snapshot_checksum(unsigned char *buf);
+void clock_snapshot(struct ClockSnapshot *s);
+void publish_time(struct Time *t);
+void publish_date(struct Date *d);
+void publish_alarm_time(struct Time *t);
+void publish_temper_limits(int min, int max);
+void publish_user_block(int secs);
+bool clock_valid(struct Time *t, struct Date *d);
+unsigned long year_seconds_at(int month, int day, int hour);
+unsigned char jalali_year_weekday(int year);
+int jalali_leaps_before(int year);
+#ifdef TEMPER_SCHEDULE
+void schedule_plan(bool at_change);
+#endif
+void clock_rebase();
+void dst_plan();
+void dst_change();
+#ifdef RTC_CHIP
+bool rtc_read(struct Time *t, struct Date *d);
+bool rtc_write(struct Time *t, struct Date *d);
+#endif
+
+// copy of the clock and the settings, refreshed by timer1_isr on every tick. after a
+// watchdog, brown-out or reset-pin reset, init() resumes from it instead of the defaults.
+struct WarmState {
+    unsigned int magic;
+    struct Time time;
+    struct Date date;
+    struct Time alarm_time;
+    bool alarm_on;
+    int temper_min;
+    int temper_max;
+    int pin;
+    bool user_blocked;
+    int user_block_time;
+    bool dst_ended;
+    unsigned char checksum; // of everything above
+};
+
+NOINIT struct WarmState warm_state;
+
+// what's kept over a power cut: time, date, alarm and the temperature limits packed into
+// SNAPSHOT_BYTES (see snapshot_save()). an eeprom byte write takes 8.5ms, so it's kept short
+// and bytes that didn't change aren't written. seq is written last and commits the slot.
+struct PowerSnapshot {
+    unsigned char seq; // SNAPSHOT_EMPTY: nothing in the slot
+    unsigned char data[SNAPSHOT_BYTES];
+    unsigned char checksum;
+};
+
+eeprom struct PowerSnapshot snapshots[SNAPSHOT_SLOTS];
+unsigned char snapshot_next = 0; // slot for the next snapshot
+unsigned char snapshot_seq = 0;
+
+// seconds since the start of date.year, kept along with the time and date by the tick so
+// a daylight saving change due is a single compare. DST_RULE picks the rule, the times are
+// wall clock times: the start in standard time, the end in daylight time.
+struct DstRule {
+    int first_year;
+    int last_year;
+    int shift; // minutes
+    unsigned char start_month;
+    unsigned char start_day;
+    unsigned char start_hour;
+    unsigned char end_month;
+    unsigned char end_day;
+    unsigned char end_hour;
+};
+
+flash struct DstRule dst_rules[] = {
+    {0, 0, 0, 1, 1, 0, 1, 1, 0}, // DST_NONE
+    {1387, 1401, 60, 1, 2, 0, 6, 31, 0} // DST_IRAN: 1 Farvardin 24:00 to 30 Shahrivar 24:00
+};
+
+unsigned long year_seconds = 0;
+unsigned long dst_next = DST_NEVER; // year_seconds of the next change
+bool dst_active = false;
+bool dst_ended = false; // this year's change back is done, the hour before it came twice
+unsigned char year_weekday = 0; // of 1 Farvardin this year, 0 is saturday
+
+#ifdef TEMPER_SCHEDULE
+// the bands, each starts on its days at its time and lasts until the next one starts.
+// schedule_next is the year_seconds of the next start, so the tick only compares.
+// owned by timer1_isr, like the limits it sets.
+struct TemperBand {
+    unsigned char days;
+    unsigned char hour;
+    unsigned char minute;
+    signed char min;
+    signed char max;
+};
+
+flash struct TemperBand temper_schedule[] = {
+    // days,         hour, minute, min, max
+    {DAYS_WORKWEEK,  7,    0,      20,  24}, // working hours
+    {DAYS_WORKWEEK,  18,   0,      18,  25},
+    {DAYS_WEEKEND,   9,    0,      19,  25},
+    {DAYS_ALL,       23,   0,      15,  22}  // night
+};
+
+#define SCHEDULE_BANDS (sizeof(temper_schedule) / sizeof(temper_schedule[0]))
+
+unsigned long schedule_next = 0;
+unsigned char schedule_band = SCHEDULE_NONE; // the band whose limits were set last
+#endif
+
+// length of a second in 1/256 timer1 counts: the nominal rate plus the correction learned
+// from the pps reference, which is kept in eeprom. the fraction is carried between seconds.
+unsigned long clock_period = CLOCK_PERIOD_NOMINAL;
+unsigned char clock_frac = 0;
+eeprom unsigned long clock_period_saved;
+
+#ifdef PPS_INPUT
+struct PpsStats {
+    unsigned char state;
+    unsigned char age; // seconds since the last pulse
+    int offset; // timer1 counts (32us) the last pulse came after our second, negative: before
+    long slew; // 1/256 counts added to the coming second to pull the phase in
+    unsigned int last_capture;
+    bool have_last;
+    unsigned long pulses;
+    unsigned int rejects;
+} pps;
+unsigned int pps_save_wait = 0;
+#endif
+
+#ifdef RTC_CHIP
+volatile bool rtc_ticked = false; // set on each square wave edge, rtc_task talks to the rtc after it
+bool rtc_write_due = false; // the user set the time or date, the rtc gets it once it's applied
+unsigned int rtc_resync_wait = 0;
+
+flash int gregorian_month_start[12] = {0, 31, 59, 90, 120, 151, 181, 212, 243, 273, 304, 334};
+flash unsigned char gregorian_month_days[12] = {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+flash unsigned char weekday_offset[12] = {0, 3, 2, 5, 0, 3, 5, 1, 4, 6, 2, 4};
+#endif
+
+volatile unsigned int sys_ticks = 0; // milliseconds, driven by timer2
+
+// run-to-completion tasks, called from the main loop when they are due.
+// period, deadline and next_run are in sys_ticks (ms). a task that finishes later
+// than "deadline" after its release counts a miss instead of silently delaying the rest.
+struct Task {
+    void (*run)(void);
+    unsigned int period;
+    unsigned int deadline;
+    unsigned char priority; // 0 is the most urgent
+    unsigned int next_run;
+    bool running;
+    unsigned int misses;
+    unsigned int worst_response;
+};
+
+struct Task tasks[] = {
+    // run,          period, deadline, priority
+    {input_task,     20,     20,       0},
+    {alert_task,     1000,   100,      1},
+    {sensor_task,    1000,   200,      2},
+    {display_task,   200,    200,      3},
+    {alarm_task,     50,     50,       1},
+    {power_task,     1000,   200,      3},
+    {light_task,     500,    200,      3},
+    {scanner_task,   SCAN_PERIOD_MS, 50, 2},
+    {watch_task,     10,     10,       2}
+#ifdef PPS_INPUT
+    , {pps_task,     1000,   200,      3}
+#endif
+#ifdef THERMOSTAT
+    , {thermostat_task, 1000, 200,     2}
+#endif
+#ifdef RTC_CHIP
+    , {rtc_task,     50,     50,       2}
+#endif
+#ifdef TRACE_REPLAY
+    , {trace_task,   100,    100,      3}
+#endif
+};
+
+#define TASK_COUNT (sizeof(tasks) / sizeof(tasks[0]))
+
+// the scanner converts one channel per run and keeps an exponentially smoothed value per
+// channel (x16). "smooth" is the filter shift: each reading moves the value by 1/2^smooth.
+struct ScanChannel {
+    unsigned char mux;
+    unsigned char smooth;
+};
+
+flash struct ScanChannel scan_channels[SCAN_CHANNELS] = {
+    {TEMPER_ADC_CHANNEL, 2},
+    {ADC_BANDGAP, 3}
+#ifdef OUTDOOR_ADC_CHANNEL
+    , {OUTDOOR_ADC_CHANNEL, 2}
+#endif
+#ifdef LIGHT_SENSOR_CHANNEL
+    , {LIGHT_SENSOR_CHANNEL, 3}
+#endif
+};
+
+unsigned int scan_values[SCAN_CHANNELS];
+unsigned char scan_primed = 0; // bit per channel, set after its first reading
+unsigned char scan_next = 0;
+unsigned char adc_mux = 0xFF; // channel ADMUX is on
+
+#ifdef OUTDOOR_ADC_CHANNEL
+int temper_outdoor_x10 = 0;
+#endif
+
+// where the cpu spends its time during the current second, power_task turns it into the
+// shares of the last second and the totals since reset. idle sleep is measured with timer2
+// (8us counts), the conversions are counted. they wait in idle sleep too, so they're
+// part of the idle time.
+struct PowerStats {
+    unsigned long idle_counts;
+    unsigned long adc_us;
+    unsigned char idle_percent;
+    unsigned char adc_percent;
+    unsigned long idle_ms;
+    unsigned long adc_ms;
+} power_stats;
+
+volatile bool adc_done = false;
+
+// one shot software timers on a hashed wheel: a timer sits in slot (expires % WHEEL_SLOTS),
+// so arming and cancelling are O(1) and each tick only looks at one slot.
+// timer_wheel_run() is called from the main loop and fires the callbacks there, not in an isr.
+struct SoftTimer {
+    struct SoftTimer *next;
+    struct SoftTimer *prev;
+    unsigned int expires;
+    bool armed;
+    void (*callback)(void);
+};
+
+struct SoftTimer *wheel[WHEEL_SLOTS];
+unsigned int wheel_now = 0; // last tick timer_wheel_run() has processed
+
+struct SoftTimer buzzer_timer = {0, 0, 0, false, buzzer_off};
+struct SoftTimer display_hold_timer = {0, 0, 0, false, 0};
+struct SoftTimer ui_wait_timer = {0, 0, 0, false, 0};
+
+void timer_arm(struct SoftTimer *t, unsigned int ms);
+void timer_cancel(struct SoftTimer *t);
+
+void push_event(unsigned char type, signed char key);
+bool pop_event(struct Event *e);
+
 
 // External Interrupt 0 handler: set temperature
-interrupt [EXT_INT0] void ext_int0_isr(void) {
-    temper_int = true;
+ISR_HANDLER(EXT_INT0, ext_int0_isr) {
+    button_edge(EVENT_BUTTON_TEMPER);
 }
 
 // External Interrupt 1 handler: set time/alarm
-interrupt [EXT_INT1] void ext_int1_isr(void) {
-    if (alarm_buzz) {
-        alarm_buzz = false;
-        lcd_clear();
-        delay_ms(50);
-    }
-    else
-        time_int = true;
+ISR_HANDLER(EXT_INT1, ext_int1_isr) {
+    button_edge(EVENT_BUTTON_TIME);
 }
 
 // External Interrupt 2 handler: set date
-interrupt [EXT_INT2] void ext_int2_isr(void) {
-    date_int = true;
+ISR_HANDLER(EXT_INT2, ext_int2_isr) {
+    button_edge(EVENT_BUTTON_DATE);
 }
 
 
 // Timer 0 overflow interrupt handler: program regular routine
-interrupt [TIM0_OVF] void timer0_ovf_isr(void)
+ISR_HANDLER(TIM0_OVF, timer0_ovf_isr)
 {
+    TCNT0=TIMER0_START;
     show_time();
-    TCNT0=0x0F;
 }
 
-interrupt [TIM1_OVF] void timer1_isr(void) { // this will be called after 1 sec each time
+// Timer 0 output compare interrupt handler: end of the digit's on time (brightness)
+ISR_HANDLER(TIM0_COMP, timer0_comp_isr)
+{
+    SEVENS_OFF(); // until the next digit
+}
+
+// Timer 2 output compare interrupt handler: 1ms system tick
+ISR_HANDLER(TIM2_COMP, timer2_comp_isr)
+{
+    sys_ticks++;
+
+    if (watch_running) {
+        watch_ms++;
+        if (watch_ms == 10) {
+            watch_ms = 0;
+            watch_seq++;
+            if (watch_mode == WATCH_COUNTDOWN) {
+                watch_cs--;
+                if (watch_cs == 0) {
+                    watch_running = false;
+                    watch_done = true;
+                }
+            }
+            else if (watch_cs < WATCH_MAX_CS)
+                watch_cs++;
+            watch_seq++;
+        }
+    }
+
+#if defined(TRACE_RECORD) || defined(TRACE_REPLAY)
+    trace_tick();
+#endif
+
+#ifndef TRACE_REPLAY
+    key_scan_wait++;
+    if (key_scan_wait == KEYPAD_SCAN_MS) {
+        key_scan_wait = 0;
+        keypad_update();
+    }
+#endif
+}
+
+// Timer1 output compare A interrupt handler: the end of a second
+ISR_HANDLER(TIM1_COMPA, timer1_isr) {
+    unsigned long next = clock_period + clock_frac;
+
+#ifdef PPS_INPUT
+    next += pps.slew;
+    pps.slew = 0;
+    if (pps.age < 255)
+        pps.age++;
+    if (pps.state == PPS_LOCKED && pps.age > PPS_HOLDOVER_SECONDS)
+        pps.state = PPS_HOLDOVER;
+#endif
+    OCR1A += next >> 8;
+    clock_frac = next & 0xFF;
+
+    clock_second();
+}
+
+void clock_second() {
+    clock_seq++; // readers retry while this is odd
+
+    uptime++;
     update_time_date();
-    update_temper();
-    delay_ms(10);
-    update_temper_led();
+    apply_pending();
     check_alarm();
 
     if (alarm_buzz) {
         buzz_numbers++;
-        if (buzz_numbers > 60) {
+        if (buzz_numbers > 60)
             alarm_buzz = false;
-            lcd_clear();
-            delay_ms(10);
-        }
-        else {
-            PORTD.6 = 1;
-            delay_ms(20);
-            PORTD.6 = 0;
-        }
+        else
+            alarm_beep = true; // alarm_task gives the actual beep
     }
 
     if (user_blocked) {
@@ -137,53 +948,167 @@ interrupt [TIM1_OVF] void timer1_isr(void) { // this will be called after 1 sec
             user_blocked = false;
         }
     }
-    
-    TCNT1H=0x7FFF >> 8;
-    TCNT1L=0x7FFF & 0xff;
+
+    warm_save();
+
+#ifdef TRACE_REPLAY
+    if (!clock_valid(&time, &date) || temper.min >= temper.max)
+        trace_invalid++;
+#endif
+
+    clock_seq++;
+}
+
+#ifdef PPS_INPUT
+// Timer1 input capture interrupt handler: the pps edge
+ISR_HANDLER(TIM1_CAPT, timer1_capt_isr)
+{
+    unsigned int capture = ICR1;
+    unsigned int period = clock_period >> 8;
+    unsigned int interval;
+    int offset;
+
+    clock_seq++; // clock_period and the pps state, for the readers in the main loop
+    if (pps.have_last) {
+        // the counts between two pulses are the length of a true second
+        interval = capture - pps.last_capture;
+        pps.last_capture = capture;
+        if (abs((int)(interval - period)) > PPS_MAX_DEVIATION) {
+            pps.rejects++;
+            clock_seq++;
+            return;
+        }
+        clock_period += ((long)((unsigned long)interval << 8) - (long)clock_period) >> 3;
+    }
+    pps.last_capture = capture;
+    pps.have_last = true;
+    pps.pulses++;
+    pps.age = 0;
+
+    // phase against the scheduled end of this second (OCR1A), which already has the earlier
+    // corrections in it. a pending compare shows as a small positive offset.
+    offset = capture - OCR1A;
+    if (offset < -(int)(period / 2))
+        offset += period;
+    offset -= pps.slew >> 8;
+    pps.offset = offset;
+
+    if (pps.state != PPS_LOCKED || abs(offset) > PPS_STEP_COUNTS)
+        pps.slew += (long)offset << 8;
+    else
+        pps.slew += (long)offset << 6; // a quarter each second
+    pps.state = PPS_LOCKED;
+    clock_seq++;
+}
+#endif
+
+
+#ifdef RTC_CHIP
+// Timer1 input capture interrupt handler: the rtc's square wave, its seconds just moved on
+ISR_HANDLER(TIM1_CAPT, rtc_sqw_isr)
+{
+    clock_second();
+    rtc_ticked = true;
+}
+#endif
+
+#ifdef POWER_FAIL_COMPARATOR
+// Analog Comparator interrupt handler: the divider went below the bandgap
+ISR_HANDLER(ANA_COMP, ana_comp_isr)
+{
+    power_fail();
 }
+#endif
 
+// ADC interrupt handler: conversion complete, wakes read_adc() from idle sleep
+ISR_HANDLER(ADC_INT, adc_isr)
+{
+    adc_done = true;
+}
 
 // Read the AD conversion result
 unsigned int read_adc(unsigned char adc_input)
 {
-    ADMUX=adc_input | ADC_VREF_TYPE;
-    // Delay needed for the stabilization of the ADC input voltage
-    delay_us(10);
-    // Start the AD conversion
-    ADCSRA|=(1<<ADSC);
-    // Wait for the AD conversion to complete
-    while ((ADCSRA & (1<<ADIF))==0);
-    ADCSRA|=(1<<ADIF);
+    if (adc_input != adc_mux) {
+        ADMUX=adc_input | ADC_VREF_TYPE;
+        adc_mux = adc_input;
+        // The input needs time to settle after the mux change: the first conversion
+        // is thrown away instead of waiting. On the same channel there's no cost.
+        // The bandgap takes longer to start than one conversion.
+        if (adc_input == ADC_BANDGAP)
+            delay_us(BANDGAP_SETTLE_US);
+        adc_convert();
+    }
+    return adc_convert();
+}
+
+unsigned int adc_convert()
+{
+    // Waits for the conversion in idle sleep. ADC noise reduction would stop clkI/O and
+    // with it timer1, the seconds, and timer0/timer2 for every conversion.
+    // If the adc interrupt comes before the sleep, the next 1ms tick wakes us.
+    adc_done = false;
+    ADCSRA|=(1<<ADIE) | (1<<ADSC);
+    while (!adc_done)
+        power_sleep(SLEEP_IDLE);
+    ADCSRA&=~(1<<ADIE);
+    power_stats.adc_us += ADC_CONVERSION_US;
     return ADCW;
 }
 
 
 void init() {
+    // a reset that didn't take the power away leaves the ram as it was
+    unsigned char reset_flags = MCUCSR;
+    bool warm = (reset_flags & ((1<<WDRF) | (1<<BORF) | (1<<EXTRF))) && !(reset_flags & (1<<PORF)) && warm_valid();
+
     // External Interrupt(s) initialization
     // INT0: On, Mode: Falling Edge
     // INT1: On, INT1 Mode: Falling Edge
     // INT2: On, INT2 Mode: Falling Edge
     GICR|=(1<<INT1) | (1<<INT0) | (1<<INT2);
-    MCUCR=(1<<ISC11) | (0<<ISC10) | (1<<ISC01) | (0<<ISC00);
-    MCUCSR=(0<<ISC2);
+    EXT_INT_FALLING();
+    MCUCSR=0x00; // clears the reset flags (and ISC2 on the mega32: INT2 on the falling edge)
     GIFR=(1<<INTF1) | (1<<INTF0) | (1<<INTF2);
         
-    //timer1 interrupt enalbe
-    TIMSK = (1<<TOIE1) | (1<<TOIE0); // enable timer1, timer0 overflow interrupt
+    // timer interrupts: timer0 overflow and compare, timer1 compare A, timer2 compare
+    TIMSK0 = (1<<TOIE0) | (1<<OCIE0);
+    TIMSK1 |= (1<<OCIE1A);
+    TIMSK2 |= (1<<OCIE2);
+#ifdef PPS_INPUT
+    TIMSK1 |= (1<<TICIE1);
+#endif
+#ifdef RTC_CHIP
+    TIMSK1 = (TIMSK1 & ~(1<<OCIE1A)) | (1<<TICIE1); // the rtc gives the second
+#endif
     
     // timer0 init
-    TCCR0=(0<<WGM00) | (0<<COM01) | (0<<COM00) | (0<<WGM01) | (0<<CS02) | (1<<CS01) | (1<<CS00);
-    TCNT0=0x0F;
+    TIMER0_CLK64();
+    TCNT0=TIMER0_START;
+    OCR0=TIMER0_START + brightness_on_time[BRIGHTNESS_LEVELS - 1];
                             
-    // timer1 init    
+    // timer1 init: the seconds
+    // Clock value: 31.250 kHz, Mode: Normal top=0xFFFF, the second ends on Compare A
+    // Input Capture on Rising Edge, Noise Canceler: On
+    clock_period = EE_READ_DWORD(&clock_period_saved);
+    if (clock_period < CLOCK_PERIOD_NOMINAL - CLOCK_PERIOD_NOMINAL / 100 ||
+        clock_period > CLOCK_PERIOD_NOMINAL + CLOCK_PERIOD_NOMINAL / 100) // erased eeprom is 0xFFFFFFFF
+        clock_period = CLOCK_PERIOD_NOMINAL;
     TCCR1A=(0<<COM1A1) | (0<<COM1A0) | (0<<COM1B1) | (0<<COM1B0) | (0<<WGM11) | (0<<WGM10);
-    TCCR1B=(0<<ICNC1) | (0<<ICES1) | (0<<WGM13) | (0<<WGM12) | (1<<CS12) | (0<<CS11) | (0<<CS10);
-    TCNT1H=0x7F;
-    TCNT1L=0xFF;
-    TCCR1A=(0<<COM1A1) | (0<<COM1A0) | (0<<COM1B1) | (0<<COM1B0) | (0<<WGM11) | (0<<WGM10);
-    TCCR1B=(0<<ICNC1) | (0<<ICES1) | (0<<WGM13) | (0<<WGM12) | (1<<CS12) | (0<<CS11) | (0<<CS10);
-    TCNT1H=0x7F;
-    TCNT1L=0xFF;
+    TCCR1B=(1<<ICNC1) | (1<<ICES1) | (0<<WGM13) | (0<<WGM12) | (1<<CS12) | (0<<CS11) | (0<<CS10);
+#ifdef RTC_CHIP
+    TCCR1B&=~(1<<ICES1); // the rtc's seconds move on at the falling edge
+#endif
+    TCNT1=0x0000;
+    OCR1A=clock_period >> 8;
+    clock_frac=clock_period & 0xFF;
+
+    // timer2 init: system tick
+    // Clock value: 125.000 kHz, Mode: CTC top=OCR2, period: 1ms
+    ASSR=0<<AS2;
+    TIMER2_CTC_CLK64();
+    TCNT2=0x00;
+    OCR2=0x7C;
 
     // ADC initialization
     // ADC Clock frequency: 500.000 kHz
@@ -192,147 +1117,378 @@ void init() {
     ADMUX=ADC_VREF_TYPE;
     ADCSRA=(1<<ADEN) | (0<<ADSC) | (0<<ADATE) | (0<<ADIF) | (0<<ADIE) | (1<<ADPS2) | (0<<ADPS1) | (0<<ADPS0);
     SFIOR=(0<<ADTS2) | (0<<ADTS1) | (0<<ADTS0); 
-    
 
-    // Alphanumeric LCD initialization:
-    // RS - PORTC.4
-    // RD - PORTC.6 (doesn't matter)
-    // EN - PORTC.5
-    // D4 - PORTC.0
-    // D5 - PORTC.1
-    // D6 - PORTC.2
-    // D7 - PORTC.3
-    // Characters/line: 16
-    lcd_init(16);
-    
-    // pins initialization
-    DDRA = 0b111111110; // A.0 to A.6: output, A.7 input
-    DDRB = 0b11110000; // B.0 to B.2: input, B.3 to B.7 output
-    DDRC = 0xFF; // C.0 to C.7: output
-    DDRD = 0b11110011;
-    
-    PORTD = 0xFF;    
-    PORTB = 0xFF;
+#ifdef POWER_FAIL_COMPARATOR
+    // Analog Comparator: On, bandgap on the positive input, AIN1 negative
+    // Interrupt on Rising Output Edge: the divider dropped below the bandgap
+    ACSR=(1<<ACBG) | (1<<ACI) | (1<<ACIE) | (1<<ACIS1) | (1<<ACIS0);
+#else
+    // Analog Comparator: Off, it's not used and draws current
+    ACSR=(1<<ACD);
+#endif
+
+    // Watchdog Timer Prescaler: OSC/2048k, about 2.1s, scheduler_run() resets it
+    WDR();
+    WDTCR=(1<<WDTOE) | (1<<WDE);
+    WDTCR=(0<<WDTOE) | (1<<WDE) | (1<<WDP2) | (1<<WDP1) | (1<<WDP0);
     
-    // default values init
-    time.hour[0] = 1;
-    time.hour[1] = 2;
-    time.min[0] = 4;
-    time.min[1] = 5;
-    time.sec[0] = 0;
-    time.sec[1] = 0;
-    
-    date.year = 1400;
-    date.month = 3;
-    date.day = 20;
+
+    // Alphanumeric LCD initialization, the pins are in board.h
+    // (the driver keeps its state in ram, so this is needed after a warm reset too.
+    // the lcd itself kept its power and its custom characters)
+    lcd_init(LCD_COLUMNS);
+    if (!warm) {
+        lcd_define_char(lcd_char_rising, LCD_CHAR_RISING);
+        lcd_define_char(lcd_char_falling, LCD_CHAR_FALLING);
+    }
     
-    temper.min = 18;
-    temper.max = 25;
+    // pins initialization, see board.h
+    DDRA = PORTA_DDR_INIT;
+    DDRB = PORTB_DDR_INIT;
+    DDRC = PORTC_DDR_INIT;
+#if defined(PPS_INPUT) || defined(RTC_CHIP)
+    DDRD = PORTD_DDR_INIT & ~(1<<ICP_BIT); // pps or rtc square wave input
+#else
+    DDRD = PORTD_DDR_INIT;
+#endif
     
-    alarm.on = false; // off
-    alarm.atime.hour[0] = 1;
-    alarm.atime.hour[1] = 3;
-    alarm.atime.min[0] = 3;
-    alarm.atime.min[1] = 0;
-    alarm.atime.sec[0] = 0;
-    alarm.atime.sec[1] = 0;
+    PORTD = PORTD_INIT;
+#ifdef RTC_CHIP
+    BIT_SET(ICP_PORT, ICP_BIT); // the square wave output is open drain
+#endif
+#ifdef POWER_FAIL_COMPARATOR
+    PORTB = PORTB_INIT & ~(1<<AIN1_BIT); // no pull-up on AIN1, it would lift the divider
+#else
+    PORTB = PORTB_INIT;
+#endif
+
+    snapshot_scan();
+
+    if (warm) {
+        warm_restore(); // the display task draws the screen once the scheduler runs
+    }
+    else if (!snapshot_restore()) { // from a snapshot the time stood still while the power was off
+        // default values init
+        time.hour[0] = 1;
+        time.hour[1] = 2;
+        time.min[0] = 4;
+        time.min[1] = 5;
+        time.sec[0] = 0;
+        time.sec[1] = 0;
+        
+        date.year = 1400;
+        date.month = 3;
+        date.day = 20;
+        
+        temper.min = 18;
+        temper.max = 25;
+        
+        alarm.on = false; // off
+        alarm.atime.hour[0] = 1;
+        alarm.atime.hour[1] = 3;
+        alarm.atime.min[0] = 3;
+        alarm.atime.min[1] = 0;
+        alarm.atime.sec[0] = 0;
+        alarm.atime.sec[1] = 0;
+    }
+
+#ifdef RTC_CHIP
+    rtc_start(); // the rtc's time and date win over the ones above
+#endif
+#if defined(TRACE_RECORD) || defined(TRACE_REPLAY)
+    trace_start(); // a replay starts from the recorded state instead
+#endif
+    clock_rebase();
     
-    show_date_temp();
-    show_alarm(0, 1);       
+    if (!warm) {
+        show_date_temp();
+        show_alarm(0, 1);
+    }
 }
 
 void show_date_temp() {
-    char lcd_output[16];
+    char lcd_output[17];
     char temp[5];
+    struct ClockSnapshot snap;
+
+    clock_snapshot(&snap);
     
     lcd_gotoxy(0, 0);
 
-    itoa(date.year, temp);
+    itoa(snap.date.year, temp);
     strcpy(lcd_output, temp);
     strcat(lcd_output, "/");
     
-    itoa(date.month, temp);
+    itoa(snap.date.month, temp);
     strcat(lcd_output, temp);
     strcat(lcd_output, "/");
     
-    itoa(date.day, temp);
+    itoa(snap.date.day, temp);
     strcat(lcd_output, temp);
     strcat(lcd_output, " ");
      
-    // itoa(temper.current, temp);
-    if (temper.negative)
-        sprintf(temp, "-%d", temper.current);
-    else
-        sprintf(temp, "%d", temper.current);
+    itoa(snap.temper.current, temp);
 
     strcat(lcd_output, temp);
     strcat(lcd_output, "C");
+
+    if (trend_warning)
+        strcat(lcd_output, "!");
+    else if (snap.temper.trend >= TREND_STEADY)
+        strcat(lcd_output, "\x01"); // LCD_CHAR_RISING
+    else if (snap.temper.trend <= -TREND_STEADY)
+        strcat(lcd_output, "\x02"); // LCD_CHAR_FALLING
+    pad_line(lcd_output);
     
     lcd_puts(lcd_output); 
 }
 
 void show_alarm(int x, int y) {
     char lcd_output[17];
-    char temp[2];
+    struct ClockSnapshot snap;
+
+    clock_snapshot(&snap);
+    format_alarm(lcd_output, &snap);
     
-    itoa(alarm.atime.hour[0], temp);
-    strcpy(lcd_output, temp);
-    itoa(alarm.atime.hour[1], temp);
-    strcat(lcd_output, temp);
+    if (x != -1 && y != -1) {
+        lcd_gotoxy(x, y);
+        pad_line(lcd_output); // overwrite what was left on the line, so no lcd_clear is needed
+    }
+
+    lcd_puts(lcd_output);
+}
+
+void format_alarm(char *out, struct ClockSnapshot *snap) {
+    char temp[2];
+
+    itoa(snap->alarm_time.hour[0], temp);
+    strcpy(out, temp);
+    itoa(snap->alarm_time.hour[1], temp);
+    strcat(out, temp);
     
-    strcat(lcd_output, ":");
+    strcat(out, ":");
     
-    itoa(alarm.atime.min[0], temp);
-    strcat(lcd_output, temp);
-    itoa(alarm.atime.min[1], temp);
-    strcat(lcd_output, temp);
+    itoa(snap->alarm_time.min[0], temp);
+    strcat(out, temp);
+    itoa(snap->alarm_time.min[1], temp);
+    strcat(out, temp);
 
-    if (!alarm_buzz) {
+    if (!snap->alarm_buzz) {
         if (alarm.on) {
-            strcat(lcd_output, ">ON");
+            strcat(out, ">ON");
         }
         else {
-            strcat(lcd_output, ">OFF");
+            strcat(out, ">OFF");
         }
     }
     else {
-        if (alarm_buzz) {
-            strcat(lcd_output, " btn2:Stop");
-            delay_ms(20);
-        }
+        strcat(out, " btn2:Stop");
     }
-    
-    if (x != -1 && y != -1)
-        lcd_gotoxy(x, y);
+}
 
-    lcd_puts(lcd_output);
-    delay_ms(20);
+void page_update(struct ClockSnapshot *snap) {
+    // the second line of the main screen, called by display_task
+    unsigned long source;
+
+    if (snap->alarm_buzz) { // the alarm page has the way to stop it
+        page_current = PAGE_ALARM;
+        page_runs = 0;
+    }
+    else if (++page_runs >= PAGE_RUNS)
+        page_next(snap);
+
+    source = lcd_pages[page_current].source(snap);
+    if (source == PAGE_HIDDEN) { // gone since it came up
+        page_next(snap);
+        source = lcd_pages[page_current].source(snap);
+    }
+
+    if (!(page_rendered & (1 << page_current)) || source != page_sources[page_current]) {
+        lcd_pages[page_current].render(page_lines[page_current], snap);
+        pad_line(page_lines[page_current]);
+        page_sources[page_current] = source;
+        page_rendered |= 1 << page_current;
+        page_shown = PAGE_NONE;
+    }
+
+    if (page_shown != page_current) {
+        lcd_gotoxy(0, 1);
+        lcd_puts(page_lines[page_current]);
+        page_shown = page_current;
+    }
+}
+
+void page_next(struct ClockSnapshot *snap) {
+    // the next page with something to show, the alarm page always has
+    unsigned char i;
+
+    page_runs = 0;
+    for (i = 0; i < PAGE_COUNT; i++) {
+        page_current++;
+        if (page_current == PAGE_COUNT)
+            page_current = 0;
+        if (lcd_pages[page_current].source(snap) != PAGE_HIDDEN)
+            return;
+    }
+    page_current = PAGE_ALARM;
+}
+
+unsigned long alarm_page_source(struct ClockSnapshot *snap) {
+    return snap->alarm_time.hour[0] | (snap->alarm_time.hour[1] << 4) | (snap->alarm_time.min[0] << 8) |
+           ((unsigned long)snap->alarm_time.min[1] << 12) | ((unsigned long)alarm.on << 16) | ((unsigned long)snap->alarm_buzz << 17);
+}
+
+void alarm_page_render(char *line, struct ClockSnapshot *snap) {
+    format_alarm(line, snap);
+}
+
+unsigned long calendar_page_source(struct ClockSnapshot *snap) {
+    return calendar_text == CALENDAR_NONE ? PAGE_HIDDEN : calendar_text;
+}
+
+void calendar_page_render(char *line, struct ClockSnapshot *snap) {
+    unsigned char i;
 
+    for (i = 0; calendar_texts[calendar_text][i] != 0; i++)
+        line[i] = calendar_texts[calendar_text][i];
+    line[i] = 0;
+}
+
+unsigned long countdown_page_source(struct ClockSnapshot *snap) {
+    // minutes to the alarm, rounded up
+    long now, at;
+
+    if (!alarm.on || snap->alarm_buzz)
+        return PAGE_HIDDEN;
+
+    now = (snap->time.hour[0] * 10 + snap->time.hour[1]) * 3600L +
+          (snap->time.min[0] * 10 + snap->time.min[1]) * 60 + snap->time.sec[0] * 10 + snap->time.sec[1];
+    at = (snap->alarm_time.hour[0] * 10 + snap->alarm_time.hour[1]) * 3600L +
+         (snap->alarm_time.min[0] * 10 + snap->alarm_time.min[1]) * 60 + snap->alarm_time.sec[0] * 10 + snap->alarm_time.sec[1];
+    if (at <= now)
+        at += SECONDS_PER_DAY;
+
+    return (at - now + 59) / 60;
+}
+
+void countdown_page_render(char *line, struct ClockSnapshot *snap) {
+    unsigned int minutes = countdown_page_source(snap);
+
+    if (minutes < 60)
+        sprintf(line, "Alarm in %um", minutes);
+    else
+        sprintf(line, "Alarm in %uh %u%um", minutes / 60, (minutes % 60) / 10, minutes % 10);
+}
+
+unsigned long today_page_source(struct ClockSnapshot *snap) {
+    if (today_day == 0)
+        return PAGE_HIDDEN;
+    return ((unsigned long)(unsigned int)today_min_x10 << 16) | (unsigned int)today_max_x10;
+}
+
+void today_page_render(char *line, struct ClockSnapshot *snap) {
+    // each value at most 5 characters ("-99.9", "999.9"), so the line stays within 16
+    char low[8];
+    char high[8];
+
+    format_x10(low, today_min_x10 < -999 ? -999 : (today_min_x10 > 9999 ? 9999 : today_min_x10));
+    format_x10(high, today_max_x10 < -999 ? -999 : (today_max_x10 > 9999 ? 9999 : today_max_x10));
+    sprintf(line, "Lo%s Hi%s", low, high);
+}
+
+unsigned long uptime_page_source(struct ClockSnapshot *snap) {
+    return snap->uptime / 60;
+}
+
+void uptime_page_render(char *line, struct ClockSnapshot *snap) {
+    unsigned long minutes = snap->uptime / 60;
+    unsigned int hours = (minutes / 60) % 24;
+
+    sprintf(line, "Up %ud %u%u:%u%u", (unsigned int)(minutes / 1440), hours / 10, hours % 10,
+            (unsigned int)(minutes % 60) / 10, (unsigned int)(minutes % 10));
+}
+
+unsigned long lockout_page_source(struct ClockSnapshot *snap) {
+    return snap->user_blocked ? snap->user_block_time : PAGE_HIDDEN;
+}
+
+void lockout_page_render(char *line, struct ClockSnapshot *snap) {
+    sprintf(line, "Locked for %ds", snap->user_block_time);
+}
+
+void calendar_update() {
+    // the binary search only runs when the date has changed, the rest of the day the
+    // cached entry is used. a new day with an entry gets a short chime
+    struct ClockSnapshot snap;
+    int key;
+    unsigned int lo = 0;
+    unsigned int hi = CALENDAR_SIZE;
+    unsigned int mid;
+
+    clock_snapshot(&snap);
+    key = CALENDAR_KEY(snap.date.month, snap.date.day);
+    if (key == calendar_key)
+        return;
+
+    while (lo < hi) { // the first entry on or after the date
+        mid = (lo + hi) >> 1;
+        if ((int)(calendar[mid] >> 7) < key)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if (lo < CALENDAR_SIZE && (int)(calendar[lo] >> 7) == key)
+        calendar_text = calendar[lo] & 0x7F;
+    else
+        calendar_text = CALENDAR_NONE;
+
+    if (calendar_text != CALENDAR_NONE && calendar_key != -1) // not at power up
+        buzzer_beep(60);
+    calendar_key = key;
 }
 
 void show_time() {
-    show_number_on_sevens(time.hour, 0);
-    show_number_on_sevens(time.min, 1);
-    show_number_on_sevens(time.sec, 2);
+    // called on every timer0 overflow and lights one digit, a whole frame takes 6 calls
+    unsigned char segment_num = seven_digit >> 1;
+    unsigned char part = seven_digit & 1;
+
+    if (led_code != led_latched) { // the leds decoder shares the digit address, so update it between two digits
+        SEVENS_OFF();
+        LED_SELECT(led_code);
+        LEDS_LATCH_PULSE(); // the leds keep their state after it
+        led_latched = led_code;
+    }
+
+    if (watch_mode != WATCH_OFF)
+        show_number_on_sevens(watch_show[segment_num], segment_num, part);
+    else if (segment_num == 0)
+        show_number_on_sevens(time.hour, segment_num, part);
+    else if (segment_num == 1)
+        show_number_on_sevens(time.min, segment_num, part);
+    else
+        show_number_on_sevens(time.sec, segment_num, part);
+
+    seven_digit++;
+    if (seven_digit == 6)
+        seven_digit = 0;
 }
 
-void show_number_on_sevens(int number[], char segment_num) {
+void show_number_on_sevens(int number[], unsigned char segment_num, unsigned char part) {
     // number => [x, x], x=[0, 9]: number that you want to show it on your double 7 segment
     // segment_num => x, x=[0, 2] : number of the double 7 segment you want to show on something (we have 3 double 7 segments)
+    // part => 0 or 1: which digit of the double 7 segment is lit, it stays lit until the next call
               
-    PORTC &= (~(1<<PORTC7)); // enable ORs decoder
-    
-    PORTD = ((1<<4)|segment_num); // selecting from double 7segments, so our 7segment is ready to get data
-    PORTA = seg_numbers[number[0]]; // sending first part of number
+    SEVENS_OFF(); // while switching, so nothing ghosts
     
-    delay_ms(1);
-                                                    
-    PORTD = ((1<<5)|segment_num); // selecting from double 7segments, so our 7segment is ready to get data    
-    PORTA = seg_numbers[number[1]]; // sending second part of number
+    // selecting from double 7segments, only the select lines are touched (the buzzer shares the port)
+    DIGIT_SELECT(segment_num, part);
+    SEG_PORT = seg_numbers[number[part]];
+#ifdef TRACE_REPLAY
+    trace_sevens[segment_num * 2 + part] = SEG_PORT;
+#endif
     
-    delay_ms(1);
-    
-    PORTC |= (1<<PORTC7); // disabling ORs decoder
+    SEVENS_ON();
 }
 
 void update_time_date() {
@@ -365,20 +1521,218 @@ void update_time_date() {
 
     if (time.hour[0] == 2 && time.hour[1] == 4) {
         time.hour[0] = 0;
-        time.hour[0] = 0;
+        time.hour[1] = 0;
 
         date.day++;  
     }
 
-    if (date.day == 30) {
-        date.day = 0;
+    if (date.day > jalali_month_days(date.year, date.month)) {
+        date.day = 1;
         date.month++;
     }
 
-    if (date.month == 12) {
-        date.month = 0;
+    if (date.month > 12) {
+        date.month = 1;
         date.year++;
+        year_seconds = 0;
+        year_weekday = (year_weekday + (jalali_leap(date.year - 1) ? 366 : 365)) % 7;
+        dst_ended = false;
+        dst_plan();
+#ifdef TEMPER_SCHEDULE
+        schedule_plan(false);
+#endif
+        return;
+    }
+
+    year_seconds++;
+#if DST_RULE != DST_NONE
+    if (year_seconds == dst_next)
+        dst_change();
+#endif
+#ifdef TEMPER_SCHEDULE
+    if (year_seconds >= schedule_next) // a daylight saving start can step over it
+        schedule_plan(true);
+#endif
+}
+
+unsigned long year_seconds_at(int month, int day, int hour) {
+    // the first six months have 31 days, the next five 30
+    int days = (month <= 7 ? (month - 1) * 31 : 186 + (month - 7) * 30) + day - 1;
+
+    return days * SECONDS_PER_DAY + hour * 3600L;
+}
+
+void clock_rebase() {
+    // timer1_isr only, after the time or date was set: year_seconds and the daylight
+    // saving state from them
+    year_seconds = year_seconds_at(date.month, date.day, time.hour[0] * 10 + time.hour[1]) +
+                   (time.min[0] * 10 + time.min[1]) * 60 + time.sec[0] * 10 + time.sec[1];
+    year_weekday = jalali_year_weekday(date.year);
+    dst_plan();
+#ifdef TEMPER_SCHEDULE
+    schedule_plan(false);
+#endif
+}
+
+unsigned char jalali_year_weekday(int year) {
+    // the weekday 1 Farvardin falls on, from 1400's. a year moves it by 1, a leap year by 2,
+    // so it's the years between plus the leap years between, all mod 7. runs in timer1_isr
+    int d = (year - 1400) % 7 + (jalali_leaps_before(year) - jalali_leaps_before(1400)) % 7;
+
+    return (WEEKDAY_1400 + d + 14) % 7; // % keeps the sign, d is above -14
+}
+
+int jalali_leaps_before(int year) {
+    // leap years in [0, year): 8 in each 33 year cycle, at 1, 5, 9, 13, 17, 22, 26, 30 in it
+    unsigned char r = year % 33;
+
+    return (year / 33) * 8 + (r <= 18 ? (r + 2) / 4 : 5 + (r - 19) / 4);
+}
+
+#ifdef TEMPER_SCHEDULE
+void schedule_plan(bool at_change) {
+    // timer1_isr only: the band in force now and when the next one starts. at a start its
+    // limits are set again even when it's the same band; after the clock was set, only
+    // when the band is another one, so limits set by hand aren't lost to every time change
+    unsigned long now = year_seconds % SECONDS_PER_DAY;
+    unsigned char weekday = (year_weekday + year_seconds / SECONDS_PER_DAY) % 7;
+    unsigned char active = SCHEDULE_NONE;
+    unsigned long active_ago = 0;
+    unsigned long next_in = DST_NEVER;
+    unsigned long start, gap;
+    unsigned char i, d;
+
+    for (i = 0; i < SCHEDULE_BANDS; i++) {
+        start = temper_schedule[i].hour * 3600L + temper_schedule[i].minute * 60;
+
+        // its last start: today if it's past, or the latest of its days before
+        for (d = 0; d < 8; d++) {
+            if (!(temper_schedule[i].days & (1 << ((weekday + 7 - d) % 7))) || (d == 0 && start > now))
+                continue;
+            gap = d * SECONDS_PER_DAY + now - start;
+            if (active == SCHEDULE_NONE || gap < active_ago) {
+                active = i;
+                active_ago = gap;
+            }
+            break;
+        }
+
+        // and its next one
+        for (d = 0; d < 8; d++) {
+            if (!(temper_schedule[i].days & (1 << ((weekday + d) % 7))) || (d == 0 && start <= now))
+                continue;
+            gap = d * SECONDS_PER_DAY + start - now;
+            if (gap < next_in)
+                next_in = gap;
+            break;
+        }
+    }
+
+    schedule_next = next_in == DST_NEVER ? DST_NEVER : year_seconds + next_in;
+    if (active == SCHEDULE_NONE || (!at_change && active == schedule_band))
+        return;
+
+    schedule_band = active;
+    temper.min = temper_schedule[active].min;
+    temper.max = temper_schedule[active].max;
+}
+#endif
+
+void dst_plan() {
+    // whether daylight saving time is on at year_seconds, and when it changes next
+    flash struct DstRule *rule = &dst_rules[DST_RULE];
+    unsigned long start, end;
+
+    dst_active = false;
+    dst_next = DST_NEVER;
+    if (DST_RULE == DST_NONE || date.year < rule->first_year || date.year > rule->last_year)
+        return;
+
+    start = year_seconds_at(rule->start_month, rule->start_day, rule->start_hour);
+    end = year_seconds_at(rule->end_month, rule->end_day, rule->end_hour);
+
+    if (year_seconds < start)
+        dst_next = start;
+    else if (year_seconds < end && !(dst_ended && year_seconds >= end - rule->shift * 60L)) {
+        dst_active = true;
+        dst_next = end;
+    }
+}
+
+void dst_change() {
+    // timer1_isr only: the hour moves forward at the start and back at the end, and the time
+    // and date are worked out again from year_seconds
+    unsigned long shift = dst_rules[DST_RULE].shift * 60L;
+    unsigned long rest;
+    unsigned int day;
+    unsigned char hour, min, sec;
+
+    if (!dst_active) {
+        year_seconds += shift;
+        dst_active = true;
+        dst_next = year_seconds_at(dst_rules[DST_RULE].end_month, dst_rules[DST_RULE].end_day, dst_rules[DST_RULE].end_hour);
+    }
+    else {
+        year_seconds -= shift;
+        dst_active = false;
+        dst_ended = true;
+        dst_next = DST_NEVER;
+    }
+
+    day = year_seconds / SECONDS_PER_DAY;
+    rest = year_seconds % SECONDS_PER_DAY;
+    hour = rest / 3600;
+    min = (rest % 3600) / 60;
+    sec = rest % 60;
+    time.hour[0] = hour / 10;
+    time.hour[1] = hour % 10;
+    time.min[0] = min / 10;
+    time.min[1] = min % 10;
+    time.sec[0] = sec / 10;
+    time.sec[1] = sec % 10;
+    if (day < 186) {
+        date.month = 1 + day / 31;
+        date.day = 1 + day % 31;
+    }
+    else {
+        date.month = 7 + (day - 186) / 30;
+        date.day = 1 + (day - 186) % 30;
     }
+
+#ifdef RTC_CHIP
+    rtc_write_due = true; // or the next resync takes the hour back
+#endif
+#ifdef TEMPER_SCHEDULE
+    schedule_plan(false);
+#endif
+}
+
+bool jalali_leap(int year) {
+    // 8 leap years in each 33 year cycle, right from 1343 to 1473
+    unsigned char r = year % 33;
+
+    return (r % 4 == 1 && r < 18) || (r % 4 == 2 && r > 18);
+}
+
+unsigned char jalali_month_days(int year, int month) {
+    if (month <= 6)
+        return 31;
+    if (month <= 11)
+        return 30;
+    return jalali_leap(year) ? 30 : 29;
+}
+
+bool clock_valid(struct Time *t, struct Date *d) {
+    // every digit in its range and the day in the month
+    if (t->hour[0] < 0 || t->hour[0] > 2 || t->hour[1] < 0 || t->hour[1] > 9 ||
+        (t->hour[0] == 2 && t->hour[1] > 3))
+        return false;
+    if (t->min[0] < 0 || t->min[0] > 5 || t->min[1] < 0 || t->min[1] > 9 ||
+        t->sec[0] < 0 || t->sec[0] > 5 || t->sec[1] < 0 || t->sec[1] > 9)
+        return false;
+
+    return d->year >= SNAPSHOT_YEAR_BASE && d->year <= YEAR_MAX &&
+        d->month >= 1 && d->month <= 12 && d->day >= 1 && d->day <= jalali_month_days(d->year, d->month);
 }
 
 int login() {
@@ -395,24 +1749,20 @@ int login() {
     int kp_input       = -1;
     int attempts       = 3; // after 3 attempts of an invalid pin, you will be throwed out to the main page
     int lcd_x;
-    char temp_number[5];
+    char temp_number[5] = "";
     char temp_output[17] = "";
     char temp[2];
 
-    delay_ms(30);
     lcd_clear();
-    delay_ms(10);
         
     lcd_gotoxy(0, 0);
     strcat(temp_output, "Pin: ----");
 
     lcd_puts(temp_output);
-    delay_ms(20);
     
     lcd_gotoxy(0, 1);
     strcpy(temp_output, "*:Exit#:ChangPin");
     lcd_puts(temp_output);
-    delay_ms(30);
 
     kp_input = -1;
     lcd_x = 5;
@@ -426,26 +1776,20 @@ int login() {
 
             lcd_gotoxy(15, 0);
             lcd_puts(temp);
-            delay_ms(30);
         }
         
-        delay_ms(30);
-        kp_input = keypad();
+        kp_input = ui_get_key();
         if (kp_input != -1) {
             if (0 <= kp_input && kp_input <= 9) {
                 strcpy(temp, "");
                 sprintf(temp, "%d", kp_input);
 
-                delay_ms(10);
-                
                 lcd_gotoxy(lcd_x, 0);
                 if (change_pin && take_new_pin) {
                     lcd_puts(temp);
-                    delay_ms(30);
                 }
                 else {
                     lcd_puts("*");
-                    delay_ms(30);
                 }
 
                 strcat(temp_number, temp);
@@ -458,13 +1802,11 @@ int login() {
                         pin = pin_number;
 
                         lcd_clear();
-                        delay_ms(20);
                         lcd_gotoxy(0, 0);
                         lcd_puts("  Pin changed  ");
-                        delay_ms(20);
                         lcd_gotoxy(0, 1);
                         lcd_puts("  Successfuly!  ");
-                        delay_ms(300);
+                        hold_display(300);
 
                         return 2; // success but user will be going to main page
                     }
@@ -475,17 +1817,14 @@ int login() {
                             entered_inputs = 0;
 
                             lcd_clear();
-                            delay_ms(10);
 
                             strcpy(temp_output, "NewPin: ----");
                             lcd_gotoxy(0, 0);
                             lcd_puts(temp_output);
-                            delay_ms(10);
 
                             strcpy(temp_output, "*:Exit #:Reset");
                             lcd_gotoxy(0, 1);
                             lcd_puts(temp_output);
-                            delay_ms(10);
 
                             lcd_x = 8;
                             continue;
@@ -499,39 +1838,33 @@ int login() {
                         lcd_gotoxy(0, 0);
                         strcpy(temp_output, "   Wrong Pin!   ");
                         lcd_puts(temp_output);
-                        delay_ms(200);
+                        ui_wait(200);
 
                         if (attempts == 0) {
-                            user_blocked = true;
-                            user_block_time = USER_BLOCK_MAX_TIME;
+                            publish_user_block(USER_BLOCK_MAX_TIME);
                             return 0; // login failed and user will be blocked to enter settings for a while
                         }
                         
                         lcd_clear();
-                        delay_ms(15);
 
                         lcd_gotoxy(0, 0);
                         if (change_pin) {
                             strcpy(temp_output, "CurntPin: ----");
                             lcd_puts(temp_output);
-                            delay_ms(15);
 
                             lcd_gotoxy(0, 1);
                             strcpy(temp_output, "*:Exit #:Reset");
                             lcd_puts(temp_output);
-                            delay_ms(15);
 
                             lcd_x = 10;
                         }
                         else {
                             strcpy(temp_output, "Pin: ----");
                             lcd_puts(temp_output);
-                            delay_ms(15);
 
                             lcd_gotoxy(0, 1);
                             strcpy(temp_output, "*:Exit#:ChangPin");
                             lcd_puts(temp_output);
-                            delay_ms(15);
 
                             lcd_x = 5;
                         }
@@ -554,17 +1887,14 @@ int login() {
                     change_pin = true;
 
                     lcd_clear();
-                    delay_ms(10);
 
                     lcd_gotoxy(0, 0);
                     strcpy(temp_output, "CurntPin: ----");
                     lcd_puts(temp_output);
-                    delay_ms(15);
 
                     lcd_gotoxy(0, 1);
                     strcpy(temp_output, "*:Exit #:Reset");
                     lcd_puts(temp_output);
-                    delay_ms(15);
 
                     lcd_x = 10;
                     attempts = 3;
@@ -579,7 +1909,6 @@ int login() {
                         
                     lcd_gotoxy(lcd_x, 0);
                     lcd_puts(temp_output);
-                    delay_ms(15);
                 }
 
                 entered_inputs = 0;
@@ -610,76 +1939,385 @@ void check_alarm() {
     }
 }
 
-void time_alarm_get_input(bool alarm_input) {
-    bool hour_part = true;
-    int kp_input = -1;
-    int lcd_x;
-    int new_hour[2] = {0};
-    int new_min[2] = {0};
+void apply_pending() {
+    // called from timer1_isr only, so nothing else writes the shared state meanwhile
+    if (pending_time || pending_date) {
+        if (pending_time)
+            memcpy(&time, &pending.time, sizeof(time));
+        if (pending_date)
+            memcpy(&date, &pending.date, sizeof(date));
+        pending_time = false;
+        pending_date = false;
+        clock_rebase();
+    }
 
-    delay_ms(30);
-    lcd_clear();
-    delay_ms(20);
-    
-    if (!alarm_input) {
-        lcd_puts("clock ");
-        delay_ms(10);
+    if (pending_alarm) {
+        memcpy(&alarm.atime, &pending.alarm_time, sizeof(alarm.atime));
+        pending_alarm = false;
     }
-    else {
-        lcd_puts("alarm ");
+
+    if (pending_temper) {
+        temper.min = pending.temper_min;
+        temper.max = pending.temper_max;
+        pending_temper = false;
     }
-        
-    lcd_puts("--:--");
-    delay_ms(10);
-        
-    lcd_gotoxy(0, 1);        
-    lcd_puts("*:discard#:reset");
-    delay_ms(10);
-        
-    delay_ms(100);
-                        
-    kp_input = -1;
-    lcd_x = 6;        
-    while(1) {
-        lcd_gotoxy(lcd_x, 0);
-        lcd_puts("_");
 
-        delay_ms(50);
-        kp_input = keypad();
-        if (kp_input != -1) {
-            if (0 <= kp_input && kp_input <= 9) {
-                char temp[2];
-                sprintf(temp, "%d", kp_input);
-                    
-                delay_ms(10);
-                lcd_gotoxy(lcd_x, 0);
-                lcd_puts(temp);                
-                delay_ms(10);
-                    
-                if (hour_part) {
-                    new_hour[lcd_x-6] = atoi(temp);
-                    lcd_x++;
-                        
-                    if (lcd_x == 8) { // end of hour
-                        if (new_hour[0] > 2 || (new_hour[0] == 2 && new_hour[1] != 4)) { // hour is bigger than 24
-                            new_hour[0] = 0;
-                            new_hour[1] = 0;
-                            lcd_x = 6; // return to the begining of hour
-                            lcd_gotoxy(6, 0);
-                            lcd_puts("--");
-                        }
-                        else { // hour is valid
-                            hour_part = false;
-                            lcd_x++;
-                        }                        
-                    }                                        
+    if (pending_block) {
+        user_block_time = pending.block_time;
+        user_blocked = true;
+        pending_block = false;
+    }
+}
+
+void warm_save() {
+    // called from timer1_isr only
+    warm_state.magic = WARM_MAGIC;
+    memcpy(&warm_state.time, &time, sizeof(time));
+    memcpy(&warm_state.date, &date, sizeof(date));
+    memcpy(&warm_state.alarm_time, &alarm.atime, sizeof(alarm.atime));
+    warm_state.alarm_on = alarm.on;
+    warm_state.temper_min = temper.min;
+    warm_state.temper_max = temper.max;
+    warm_state.pin = pin;
+    warm_state.user_blocked = user_blocked;
+    warm_state.user_block_time = user_block_time;
+    warm_state.dst_ended = dst_ended;
+    warm_state.checksum = warm_checksum();
+}
+
+bool warm_valid() {
+    return warm_state.magic == WARM_MAGIC && warm_state.checksum == warm_checksum() &&
+           clock_valid(&warm_state.time, &warm_state.date);
+}
+
+void warm_restore() {
+    memcpy(&time, &warm_state.time, sizeof(time));
+    memcpy(&date, &warm_state.date, sizeof(date));
+    memcpy(&alarm.atime, &warm_state.alarm_time, sizeof(alarm.atime));
+    alarm.on = warm_state.alarm_on;
+    temper.min = warm_state.temper_min;
+    temper.max = warm_state.temper_max;
+    pin = warm_state.pin;
+    user_blocked = warm_state.user_blocked;
+    user_block_time = warm_state.user_block_time;
+    dst_ended = warm_state.dst_ended;
+}
+
+unsigned char warm_checksum() {
+    // rotate and add, so swapped bytes don't cancel out
+    unsigned char *p = (unsigned char *)&warm_state;
+    unsigned char sum = 0xA5;
+    unsigned char i;
+
+    for (i = 0; i < sizeof(warm_state) - 1; i++)
+        sum = ((sum << 1) | (sum >> 7)) + p[i];
+
+    return sum;
+}
+
+void power_fail() {
+    // called with interrupts off, it doesn't come back: the power goes, or it returns and
+    // the watchdog resets into the warm restart. timer1 alone stays on meanwhile, so the
+    // seconds of a dip that didn't take the power away are still counted into warm_state
+    unsigned char timer1 = TIMSK1 & ((1<<OCIE1A) | (1<<TICIE1));
+
+    TIMSK0 = 0;
+    TIMSK1 = 0;
+    TIMSK2 = 0;
+    GICR &= ~((1<<INT1) | (1<<INT0) | (1<<INT2));
+    ACSR &= ~(1<<ACIE); // no second power fail from a bounce while we wait
+    SEVENS_OFF();
+    BUZZER_OFF();
+    RELAY_OFF();
+
+    snapshot_save();
+
+    TIMSK1 = timer1; // on the mega32 this is the one TIMSK of all three timers
+    SEI();
+    while (!power_good()) {
+        WDR();
+    }
+    while (1)
+        ;
+}
+
+bool power_good() {
+#ifdef POWER_FAIL_COMPARATOR
+    return !(ACSR & (1<<ACO)); // ACO: the bandgap is above the divider
+#else
+    // polled, the adc interrupt can't wake us with interrupts off
+    ADCSRA &= ~(1<<ADIE);
+    if (adc_mux != ADC_BANDGAP) {
+        ADMUX = ADC_BANDGAP | ADC_VREF_TYPE;
+        adc_mux = ADC_BANDGAP;
+        delay_us(BANDGAP_SETTLE_US);
+    }
+    ADCSRA |= (1<<ADSC);
+    while (ADCSRA & (1<<ADSC))
+        ;
+    return ADCW <= POWER_FAIL_BANDGAP;
+#endif
+}
+
+void snapshot_scan() {
+    // finds the newest snapshot and clears the slot after it, so the power fail only writes
+    unsigned char i;
+    bool found = false;
+
+    for (i = 0; i < SNAPSHOT_SLOTS; i++) {
+        unsigned char seq = EE_READ_BYTE(&snapshots[i].seq);
+        if (seq == SNAPSHOT_EMPTY)
+            continue;
+        if (!found || (signed char)(seq - snapshot_seq) >= 0) { // sequence numbers wrap
+            snapshot_next = i;
+            snapshot_seq = seq;
+            found = true;
+        }
+    }
+
+    if (found) {
+        snapshot_next = (snapshot_next + 1) % SNAPSHOT_SLOTS;
+        snapshot_seq = snapshot_seq == SNAPSHOT_EMPTY - 1 ? 0 : snapshot_seq + 1;
+    }
+
+    if (EE_READ_BYTE(&snapshots[snapshot_next].seq) != SNAPSHOT_EMPTY)
+        EE_WRITE_BYTE(&snapshots[snapshot_next].seq, SNAPSHOT_EMPTY);
+}
+
+void snapshot_save() {
+    // 62 bits: hour 5, minute 6, second 6, year 7 (from SNAPSHOT_YEAR_BASE), month 4, day 5,
+    // alarm hour 5, alarm minute 6, alarm on 1, min and max temperature 8 each, dst_ended 1
+    unsigned char buf[SNAPSHOT_BYTES];
+    unsigned char bit = 0;
+    unsigned char i;
+    EE_PTR(struct PowerSnapshot) slot = &snapshots[snapshot_next];
+
+    if (!clock_valid(&time, &date)) // a year out of the 7 bits would come back as another one
+        return;
+
+    memset(buf, 0, sizeof(buf));
+    snapshot_put(buf, &bit, time.hour[0] * 10 + time.hour[1], 5);
+    snapshot_put(buf, &bit, time.min[0] * 10 + time.min[1], 6);
+    snapshot_put(buf, &bit, time.sec[0] * 10 + time.sec[1], 6);
+    snapshot_put(buf, &bit, date.year - SNAPSHOT_YEAR_BASE, 7);
+    snapshot_put(buf, &bit, date.month, 4);
+    snapshot_put(buf, &bit, date.day, 5);
+    snapshot_put(buf, &bit, alarm.atime.hour[0] * 10 + alarm.atime.hour[1], 5);
+    snapshot_put(buf, &bit, alarm.atime.min[0] * 10 + alarm.atime.min[1], 6);
+    snapshot_put(buf, &bit, alarm.on, 1);
+    snapshot_put(buf, &bit, (unsigned char)temper.min, 8);
+    snapshot_put(buf, &bit, (unsigned char)temper.max, 8);
+    snapshot_put(buf, &bit, dst_ended, 1);
+
+    for (i = 0; i < SNAPSHOT_BYTES; i++)
+        if (EE_READ_BYTE(&slot->data[i]) != buf[i])
+            EE_WRITE_BYTE(&slot->data[i], buf[i]);
+    if (EE_READ_BYTE(&slot->checksum) != snapshot_checksum(buf))
+        EE_WRITE_BYTE(&slot->checksum, snapshot_checksum(buf));
+    EE_WRITE_BYTE(&slot->seq, snapshot_seq);
+}
+
+bool snapshot_restore() {
+    // newest snapshot is the one before snapshot_next, see snapshot_scan(). a torn or bad
+    // one falls back to the one before it, up to the cleared slot at snapshot_next
+    unsigned char back;
+
+    for (back = 1; back < SNAPSHOT_SLOTS; back++)
+        if (snapshot_load((snapshot_next + SNAPSHOT_SLOTS - back) % SNAPSHOT_SLOTS))
+            return true;
+
+    dst_ended = false; // a bad slot may have left it set
+    return false;
+}
+
+bool snapshot_load(unsigned char index) {
+    // the slot into the clock and the settings, true when it passed the checks
+    unsigned char buf[SNAPSHOT_BYTES];
+    unsigned char bit = 0;
+    unsigned char i;
+    unsigned int value;
+    EE_PTR(struct PowerSnapshot) slot = &snapshots[index];
+
+    if (EE_READ_BYTE(&slot->seq) == SNAPSHOT_EMPTY)
+        return false;
+    for (i = 0; i < SNAPSHOT_BYTES; i++)
+        buf[i] = EE_READ_BYTE(&slot->data[i]);
+    if (EE_READ_BYTE(&slot->checksum) != snapshot_checksum(buf))
+        return false;
+
+    value = snapshot_get(buf, &bit, 5);
+    time.hour[0] = value / 10;
+    time.hour[1] = value % 10;
+    value = snapshot_get(buf, &bit, 6);
+    time.min[0] = value / 10;
+    time.min[1] = value % 10;
+    value = snapshot_get(buf, &bit, 6);
+    time.sec[0] = value / 10;
+    time.sec[1] = value % 10;
+    date.year = SNAPSHOT_YEAR_BASE + snapshot_get(buf, &bit, 7);
+    date.month = snapshot_get(buf, &bit, 4);
+    date.day = snapshot_get(buf, &bit, 5);
+    value = snapshot_get(buf, &bit, 5);
+    alarm.atime.hour[0] = value / 10;
+    alarm.atime.hour[1] = value % 10;
+    value = snapshot_get(buf, &bit, 6);
+    alarm.atime.min[0] = value / 10;
+    alarm.atime.min[1] = value % 10;
+    alarm.atime.sec[0] = 0;
+    alarm.atime.sec[1] = 0;
+    alarm.on = snapshot_get(buf, &bit, 1);
+    temper.min = (signed char)snapshot_get(buf, &bit, 8);
+    temper.max = (signed char)snapshot_get(buf, &bit, 8);
+    dst_ended = snapshot_get(buf, &bit, 1); // the clock was already set back this year
+
+    return clock_valid(&time, &date) && temper.min < temper.max; // else the defaults go over it
+}
+
+void snapshot_put(unsigned char *buf, unsigned char *bit, unsigned int value, unsigned char width) {
+    // lowest bit first
+    while (width--) {
+        if (value & 1)
+            buf[*bit >> 3] |= 1 << (*bit & 7);
+        value >>= 1;
+        (*bit)++;
+    }
+}
+
+unsigned int snapshot_get(unsigned char *buf, unsigned char *bit, unsigned char width) {
+    unsigned int value = 0;
+    unsigned char i;
+
+    for (i = 0; i < width; i++, (*bit)++)
+        if (buf[*bit >> 3] & (1 << (*bit & 7)))
+            value |= 1 << i;
+
+    return value;
+}
+
+unsigned char snapshot_checksum(unsigned char *buf) {
+    // same rotate and add as warm_checksum(), never 0xFF so an erased slot doesn't pass
+    unsigned char sum = 0x5A;
+    unsigned char i;
+
+    for (i = 0; i < SNAPSHOT_BYTES; i++)
+        sum = ((sum << 1) | (sum >> 7)) + buf[i];
+
+    return sum == 0xFF ? 0 : sum;
+}
+
+void clock_snapshot(struct ClockSnapshot *s) {
+    unsigned char seq;
+
+    do {
+        seq = clock_seq;
+        MEMORY_BARRIER();
+
+        memcpy(&s->time, &time, sizeof(time));
+        memcpy(&s->date, &date, sizeof(date));
+        memcpy(&s->temper, &temper, sizeof(temper));
+        memcpy(&s->alarm_time, &alarm.atime, sizeof(alarm.atime));
+        s->alarm_buzz = alarm_buzz;
+        s->user_blocked = user_blocked;
+        s->user_block_time = user_block_time;
+        s->uptime = uptime;
+        MEMORY_BARRIER();
+    } while ((seq & 1) || seq != clock_seq); // a tick came in between, copy again
+}
+
+// the publish functions clear the flag before touching the buffer, so the isr never
+// applies a half written value. the change shows up on the next tick.
+void publish_time(struct Time *t) {
+    pending_time = false;
+    memcpy(&pending.time, t, sizeof(pending.time));
+    pending_time = true;
+}
+
+void publish_date(struct Date *d) {
+    pending_date = false;
+    memcpy(&pending.date, d, sizeof(pending.date));
+    pending_date = true;
+}
+
+void publish_alarm_time(struct Time *t) {
+    pending_alarm = false;
+    memcpy(&pending.alarm_time, t, sizeof(pending.alarm_time));
+    pending_alarm = true;
+}
+
+void publish_temper_limits(int min, int max) {
+    pending_temper = false;
+    pending.temper_min = min;
+    pending.temper_max = max;
+    pending_temper = true;
+}
+
+void publish_user_block(int secs) {
+    pending_block = false;
+    pending.block_time = secs;
+    pending_block = true;
+}
+
+void time_alarm_get_input(bool alarm_input) {
+    bool hour_part = true;
+    int kp_input = -1;
+    int lcd_x;
+    int new_hour[2] = {0};
+    int new_min[2] = {0};
+    struct Time new_time;
+
+    lcd_clear();
+    
+    if (!alarm_input) {
+        lcd_puts("clock ");
+    }
+    else {
+        lcd_puts("alarm ");
+    }
+        
+    lcd_puts("--:--");
+        
+    lcd_gotoxy(0, 1);        
+    lcd_puts("*:discard#:reset");
+
+    kp_input = -1;
+    lcd_x = 6;        
+    while(1) {
+        lcd_gotoxy(lcd_x, 0);
+        lcd_puts("_");
+
+        kp_input = ui_get_key();
+        if (kp_input != -1) {
+            if (0 <= kp_input && kp_input <= 9) {
+                char temp[2];
+                sprintf(temp, "%d", kp_input);
+                    
+                lcd_gotoxy(lcd_x, 0);
+                lcd_puts(temp);                
+                    
+                if (hour_part) {
+                    new_hour[lcd_x-6] = atoi(temp);
+                    lcd_x++;
+                        
+                    if (lcd_x == 8) { // end of hour
+                        if (new_hour[0] > 2 || (new_hour[0] == 2 && new_hour[1] > 3)) { // hour is 24 or more
+                            new_hour[0] = 0;
+                            new_hour[1] = 0;
+                            lcd_x = 6; // return to the begining of hour
+                            lcd_gotoxy(6, 0);
+                            lcd_puts("--");
+                        }
+                        else { // hour is valid
+                            hour_part = false;
+                            lcd_x++;
+                        }                        
+                    }                                        
                 }
                 else {
                     new_min[lcd_x-9] = atoi(temp);
                     lcd_x++;
                         
                     if (lcd_x == 11) { // end of minute
-                        if (new_min[0] > 6 || (new_min[0] == 6 && new_min[1] != 0)) { // minute is bigger than 60
+                        if (new_min[0] > 5) { // minute is 60 or more
                             new_min[0] = 0;
                             new_min[1] = 0;
                             lcd_x = 9; // return to the begining of minute
@@ -698,7 +2336,6 @@ void time_alarm_get_input(bool alarm_input) {
             else if (kp_input == KEYPAD_SQUARE) {
                 lcd_gotoxy(6, 0);
                 lcd_puts("--:--");
-                delay_ms(10);
                     
                 lcd_x = 6;
                 hour_part = true;                                                        
@@ -706,51 +2343,44 @@ void time_alarm_get_input(bool alarm_input) {
         }                                                    
     }
         
+    new_time.hour[0] = new_hour[0];
+    new_time.hour[1] = new_hour[1];
+        
+    new_time.min[0] = new_min[0];
+    new_time.min[1] = new_min[1];
+        
+    new_time.sec[0] = 0;
+    new_time.sec[1] = 0;
+
     if (!alarm_input) {
-        time.hour[0] = new_hour[0];
-        time.hour[1] = new_hour[1];
-            
-        time.min[0] = new_min[0];
-        time.min[1] = new_min[1];
-            
-        time.sec[0] = 0;
-        time.sec[1] = 0;
-    }
-    else {
-        alarm.atime.hour[0] = new_hour[0];
-        alarm.atime.hour[1] = new_hour[1];
-            
-        alarm.atime.min[0] = new_min[0];
-        alarm.atime.min[1] = new_min[1];
-            
-        alarm.atime.sec[0] = 0;
-        alarm.atime.sec[1] = 0;
+        publish_time(&new_time);
+#ifdef RTC_CHIP
+        rtc_write_due = true;
+#endif
     }
+    else
+        publish_alarm_time(&new_time);
         
-    delay_ms(30);                    
     lcd_clear();
-    delay_ms(50);
 }
 
 void set_time_alarm_int() {
     bool clock_set = true;
     int kp_input = -1;
+    struct ClockSnapshot snap;
 
-    if (user_blocked) {
-        char temp[7];
-        delay_ms(10);
+    clock_snapshot(&snap);
+    if (snap.user_blocked) {
+        char temp[17];
         lcd_clear();
-        delay_ms(10);
         lcd_puts("Wait ");
-        delay_ms(10);
 
-        sprintf(temp, "%dsecs and", user_block_time);
+        sprintf(temp, "%dsecs and", snap.user_block_time);
         lcd_puts(temp);
-        delay_ms(10);
 
         lcd_gotoxy(0, 1);
         lcd_puts("then try again");
-        delay_ms(200);
+        hold_display(200);
 
         return;   
     }
@@ -761,21 +2391,16 @@ void set_time_alarm_int() {
             return;
     }
     
-    delay_ms(20);
     lcd_clear();
-    delay_ms(10);
     
     lcd_gotoxy(0, 0);
     lcd_puts("1:Clock 3:Alarm");
-    delay_ms(10);
     
     lcd_gotoxy(0, 1);
     lcd_puts("*:Discard");
-    delay_ms(10);
     
     while(1) {
-        delay_ms(40);
-        kp_input = keypad();
+        kp_input = ui_get_key();
         if (kp_input != -1) {
             if (kp_input == 1) {
                 clock_set = true;
@@ -790,9 +2415,7 @@ void set_time_alarm_int() {
         }                                                    
     }
     
-    delay_ms(20);
     lcd_clear();
-    delay_ms(10);
     
     lcd_gotoxy(0, 0);
     if (!clock_set) { // alarm setting part
@@ -800,22 +2423,18 @@ void set_time_alarm_int() {
         
         if (alarm.on) {
             lcd_puts(" 1:OFF");
-            delay_ms(10);
         }
         else {
             lcd_puts(" 1:ON");
-            delay_ms(10);
         }
     
         lcd_gotoxy(0, 1);
         lcd_puts("*:Discard #:Set");
-        delay_ms(10);
 
         
         kp_input = -1;        
         while(1) {
-            delay_ms(50);
-            kp_input = keypad();
+            kp_input = ui_get_key();
             if (kp_input != -1) {
                 if (kp_input == 1) {
                     if (alarm.on)
@@ -827,11 +2446,9 @@ void set_time_alarm_int() {
                     
                     if (alarm.on) {
                         lcd_puts(" 1:OFF");
-                        delay_ms(10);
                     }
                     else {
                         lcd_puts(" 1:ON");
-                        delay_ms(10);
                     }
                 }
                 else if (kp_input == KEYPAD_STAR) {
@@ -853,7 +2470,7 @@ void set_time_alarm_int() {
 
     lcd_gotoxy(0, 0);
     lcd_puts("Successfuly set!");
-    delay_ms(200);
+    hold_display(200);
             
 }
 
@@ -862,23 +2479,21 @@ void set_temper_int() {
     int kp_input = -1;
     int number;
     int input_len = 0;
-    char new_temper[4];
+    char new_temper[7];
+    struct ClockSnapshot snap;
 
-    if (user_blocked) {
-        char temp[7];
-        delay_ms(10);
+    clock_snapshot(&snap);
+    if (snap.user_blocked) {
+        char temp[17];
         lcd_clear();
-        delay_ms(10);
         lcd_puts("Wait ");
-        delay_ms(10);
 
-        sprintf(temp, "%dsecs and", user_block_time);
+        sprintf(temp, "%dsecs and", snap.user_block_time);
         lcd_puts(temp);
-        delay_ms(10);
 
         lcd_gotoxy(0, 1);
         lcd_puts("then try again");
-        delay_ms(200);
+        hold_display(200);
 
         return;   
     }
@@ -889,35 +2504,26 @@ void set_temper_int() {
             return;
     }
     
-    delay_ms(30);
     lcd_clear();
-    delay_ms(10);
         
     lcd_gotoxy(0, 0);
     lcd_puts("min:");
-    delay_ms(10);
     
-    sprintf(new_temper, "%d", temper.min);
+    sprintf(new_temper, "%d", snap.temper.min);
     lcd_puts(new_temper);
-    delay_ms(10);
     
     lcd_gotoxy(4+strlen(new_temper), 0);    
     lcd_puts(" max:");
-    delay_ms(20);
     
-    sprintf(new_temper, "%d", temper.max);
+    sprintf(new_temper, "%d", snap.temper.max);
     lcd_puts(new_temper);                 
-    delay_ms(10);
     
     lcd_gotoxy(0, 1);
     lcd_puts("*:Discard #:Edit");
-    delay_ms(10);
     
     while(1) {
-        delay_ms(50);
-        kp_input = keypad();
+        kp_input = ui_get_key();
         if (kp_input != -1) {
-            delay_ms(10);
             if (kp_input == KEYPAD_STAR)
                 return;
             else if(kp_input == KEYPAD_SQUARE)
@@ -927,18 +2533,15 @@ void set_temper_int() {
     
     strcpy(new_temper, "");
     
-    delay_ms(10);                    
     lcd_clear();
-    delay_ms(10);
         
     lcd_gotoxy(0, 0);
     lcd_puts("0:Min, 1:Max");
     lcd_gotoxy(0, 1);
-    lcd_puts("*:Discard");
+    lcd_puts("2:Cal *:Discard");
     
     while(1) {
-        delay_ms(50);
-        kp_input = keypad();
+        kp_input = ui_get_key();
         if (kp_input != -1) {
             if (kp_input == 0) {
                 temper_min = true;
@@ -948,52 +2551,44 @@ void set_temper_int() {
                 temper_min = false;
                 break;
             }
+            else if (kp_input == 2) {
+                set_temper_cal();
+                return;
+            }
             else if (kp_input == KEYPAD_STAR) {
                 return;
             }
         }                                                    
     }
             
-    delay_ms(10);                    
     lcd_clear();
-    delay_ms(10);
         
     lcd_gotoxy(0, 0);
     if (temper_min) {
         lcd_puts("Min: ");
-        delay_ms(10);
     }
     else {
         lcd_puts("Max: ");
-        delay_ms(10);
     }
         
     lcd_gotoxy(0, 1);
-    delay_ms(10);
     lcd_puts("*:Discard #:Save");
-    
-    delay_ms(10);
-    
+
     kp_input = -1;                
     while(1) {
-        delay_ms(50);
-        kp_input = keypad();
+        kp_input = ui_get_key();
         if (kp_input != -1) {
             if (0 <= kp_input && kp_input <= 9) {
                 char temp[2];
                 sprintf(temp, "%d", kp_input);
                 strcat(new_temper, temp);
                 
-                delay_ms(10);
                 lcd_gotoxy(6, 0);
                 lcd_puts(new_temper);                
-                delay_ms(10);
                 
                 kp_input = -1;
                 input_len++;
-                
-                delay_ms(10);
-                
+
                 if (input_len == 3) {
                     break;                       
                 }            
@@ -1009,65 +2604,52 @@ void set_temper_int() {
     
     number = atoi(new_temper);
     if (temper_min) { // checking errors of input and if there is no error then save it
-        if (number >= temper.max) {
-            delay_ms(20);                    
+        if (number >= snap.temper.max) {
             lcd_clear();
-            delay_ms(10);
         
             lcd_gotoxy(0, 0);
             lcd_puts("Min can't be");
-            delay_ms(10);
             lcd_gotoxy(0, 1);
             lcd_puts("bigger than max!");
-            delay_ms(300);
+            hold_display(300);
         }
         else {
-            temper.min = number;
+            publish_temper_limits(number, snap.temper.max);
             
-            delay_ms(20);                    
             lcd_clear();
-            delay_ms(10);
             
             lcd_gotoxy(0, 0);
             lcd_puts("Successfuly set!");
-            delay_ms(200);
+            hold_display(200);
         }
     }
     else {                  
-        if (number <= temper.min) {
-            delay_ms(20);                    
+        if (number <= snap.temper.min) {
             lcd_clear();
-            delay_ms(10);
         
             lcd_gotoxy(0, 0);
             lcd_puts("Max can't be");
-            delay_ms(20);
             lcd_gotoxy(0, 1);
             lcd_puts("smaller than min!");
-            delay_ms(300);
+            hold_display(300);
         }
         else if (number > 100) {
-            delay_ms(30);                    
             lcd_clear();
-            delay_ms(30);
         
             lcd_gotoxy(0, 0);
             lcd_puts("Max can't be");
-            delay_ms(20);
             lcd_gotoxy(0, 1);
             lcd_puts("bigger than 100");
-            delay_ms(300);
+            hold_display(300);
         }
         else {
-            temper.max = number; 
+            publish_temper_limits(snap.temper.min, number);
                         
-            delay_ms(30);
             lcd_clear();
-            delay_ms(30);
             
             lcd_gotoxy(0, 0);
             lcd_puts("Successfuly set!");
-            delay_ms(200);
+            hold_display(200);
         }
     }
 }
@@ -1076,24 +2658,23 @@ void set_date_int() {
     int kp_input = -1;
     int new_year, new_month, new_day;
     int lcd_x;
-    char temp_number[5];
+    char temp_number[5] = "";
     char temp[2];
+    struct Date new_date;
+    struct ClockSnapshot snap;
 
-    if (user_blocked) {
-        char temp[7];
-        delay_ms(10);
+    clock_snapshot(&snap);
+    if (snap.user_blocked) {
+        char temp[17];
         lcd_clear();
-        delay_ms(10);
         lcd_puts("Wait ");
-        delay_ms(10);
 
-        sprintf(temp, "%dsecs and", user_block_time);
+        sprintf(temp, "%dsecs and", snap.user_block_time);
         lcd_puts(temp);
-        delay_ms(10);
 
         lcd_gotoxy(0, 1);
         lcd_puts("then try again");
-        delay_ms(200);
+        hold_display(200);
 
         return;   
     }
@@ -1104,20 +2685,15 @@ void set_date_int() {
             return;
     }
 
-    delay_ms(30);
     lcd_clear();
-    delay_ms(10);
         
     lcd_gotoxy(0, 0);
     lcd_puts("date: ");
-    delay_ms(10);
 
     lcd_puts("----/--/--"); // year: 6-9, month: 11-12, day: 14-15
-    delay_ms(10);
     
     lcd_gotoxy(0, 1);
     lcd_puts("*:Discard#:Reset");
-    delay_ms(10);
 
     kp_input = -1;
     lcd_x = 6;
@@ -1125,35 +2701,42 @@ void set_date_int() {
         lcd_gotoxy(lcd_x, 0);
         lcd_puts("_");
         
-        delay_ms(50);
-        kp_input = keypad();
+        kp_input = ui_get_key();
         if (kp_input != -1) {
             if (0 <= kp_input && kp_input <= 9) {
                 sprintf(temp, "%d", kp_input);
 
-                delay_ms(10);
                 lcd_gotoxy(lcd_x, 0);
                 lcd_puts(temp);                
-                delay_ms(10);
 
                 strcat(temp_number, temp);
 
-                if (lcd_x == 9) { // end of year part, year is always valid
+                if (lcd_x == 9) { // end of year part
                     new_year = atoi(temp_number);
                     strcpy(temp_number, "");
-                    lcd_x++;
+
+                    if (new_year < SNAPSHOT_YEAR_BASE || new_year > YEAR_MAX) {
+                        new_year = 0;
+                        lcd_x = 6;
+
+                        lcd_gotoxy(lcd_x, 0);
+                        lcd_puts("----");
+                        continue;
+                    }
+                    else { // year is valid
+                        lcd_x++;
+                    }
                 }
                 else if (lcd_x == 12) { // end of month part
                     new_month = atoi(temp_number);
                     strcpy(temp_number, "");
 
-                    if (new_month > 12) {
+                    if (new_month < 1 || new_month > 12) {
                         new_month = 0;
                         lcd_x = 11;
 
                         lcd_gotoxy(lcd_x, 0);
                         lcd_puts("--");
-                        delay_ms(10);
                         continue;
                     }
                     else { // day is valid
@@ -1164,13 +2747,12 @@ void set_date_int() {
                     new_day = atoi(temp_number);
                     strcpy(temp_number, "");
 
-                    if (new_day > 30) {
+                    if (new_day < 1 || new_day > jalali_month_days(new_year, new_month)) {
                         new_day = 0;
                         lcd_x = 14;
 
                         lcd_gotoxy(lcd_x, 0);
                         lcd_puts("--");
-                        delay_ms(10);
                         continue;
                     }
                     else { // day is valid
@@ -1193,145 +2775,1722 @@ void set_date_int() {
 
                 lcd_gotoxy(6, 0);
                 lcd_puts("----/--/--");
-                delay_ms(10);
 
                 lcd_x = 6;
             }
         }                                                    
     }
 
-    date.year = new_year;
-    date.month = new_month;
-    date.day = new_day;
+    new_date.year = new_year;
+    new_date.month = new_month;
+    new_date.day = new_day;
+    publish_date(&new_date);
+#ifdef RTC_CHIP
+    rtc_write_due = true;
+#endif
 
-    delay_ms(30);
     lcd_clear();
-    delay_ms(30);
     
     lcd_gotoxy(0, 0);
     lcd_puts("Successfuly set!");
-    delay_ms(200);
+    hold_display(200);
 }
 
-void update_temper() {
-    int input;
-    input = read_adc(7);
-    input = input*4.88/10;
+unsigned int get_ticks() {
+    unsigned int t;
 
-    if (input < 0) {
-        temper.negative = true;
-        input *= -1;
-    }
-    else
-        temper.negative = false;
-    
-    temper.current = input;
+    do {
+        t = sys_ticks;
+    } while (t != sys_ticks); // the tick isr may come in between the two byte reads
+
+    return t;
 }
 
-void update_temper_led() {
-    bool min_or_max = false;
+void scheduler_run() {
+    // runs the most urgent due task, or sleeps until the next interrupt if none is due
+    unsigned char i;
+    unsigned int now = get_ticks();
+    unsigned int response;
+    unsigned char menus;
+    struct Task *task = 0;
 
-    PORTC &= (~(1<<PORTC6)); // enable leds decode
-    
-    delay_ms(10);
+    WDR(); // every pass, also the ones nested in a menu waiting for a key
 
-    if (temper.current < temper.min) {
-        PORTD.0 = 0;
-        PORTD.1 = 0;
-        
-        min_or_max = true;
+    timer_wheel_run();
+
+    for (i = 0; i < TASK_COUNT; i++) {
+        if (tasks[i].running || (int)(now - tasks[i].next_run) < 0)
+            continue;
+
+        if (task == 0 || tasks[i].priority < task->priority)
+            task = &tasks[i];
     }
-    else if (temper.current > temper.max) {
-        PORTD.0 = 0;
-        PORTD.1 = 1;
-        
-        min_or_max = true;
+
+    if (task == 0) {
+        power_sleep(SLEEP_IDLE); // any interrupt wakes us, at the latest the next 1ms tick
+        return;
     }
-    else {
-        PORTD.0 = 1;
-        PORTD.1 = 0;
 
-        temper_buzz_alowed = true;
-        min_or_max = false;
+    menus = menu_opened;
+    task->running = true;
+    task->run();
+    task->running = false;
+
+    // a run that sat in a menu took as long as the user did, that's no miss
+    response = get_ticks() - task->next_run;
+    if (menus == menu_opened) {
+        if (response > task->worst_response)
+            task->worst_response = response;
+        if (response > task->deadline)
+            task->misses++;
     }
 
-    if (temper_buzz_alowed && min_or_max) {
-        PORTD.6 = 1;
-        delay_ms(100);
-        PORTD.6 = 0;
+    task->next_run += task->period;
+    if ((int)(get_ticks() - task->next_run) >= 0) // fell a whole period behind, don't try to catch up
+        task->next_run = get_ticks() + task->period;
+}
 
-        temper_buzz_alowed = false;
+void input_task() {
+    // serves one queued event per run, oldest first
+    struct Event e;
+
+    if (!pop_event(&e))
+        return;
+
+    if (e.type == EVENT_KEY) {
+        main_screen_key(e.key);
+        page_shown = PAGE_NONE; // its screens write over the line
+        return;
     }
-    
-    delay_ms(10);    
-    PORTC |= (1<<PORTC6); // disable leds and NANDs decoder
+
+    // the menus below wait for keys through ui_get_key(), which keeps the other tasks
+    // running meanwhile; display_task leaves the lcd alone until the menu returns
+    menu_open = true;
+    menu_opened++;
+
+    if (e.type == EVENT_BUTTON_TEMPER)
+        set_temper_int();
+    else if (e.type == EVENT_BUTTON_TIME)
+        set_time_alarm_int();
+    else if (e.type == EVENT_BUTTON_DATE)
+        set_date_int();
+
+    menu_open = false;
+    page_shown = PAGE_NONE; // whatever the menu left on the lcd
 }
 
-int keypad()
-{
-    int i = -1;
-    
-    PORTB.4 = 0;
-    if (PINB.0 == 0) { delay_ms(10); i = 1; }
-    if (PINB.1 == 0) { delay_ms(10); i = 2; }
-    if (PINB.3 == 0) { delay_ms(10); i = 3; }
-    PORTB.4 = 1;
-          
-    PORTB.5 = 0;
-    if (PINB.0 == 0) { delay_ms(10); i = 4; }
-    if (PINB.1 == 0) { delay_ms(10); i = 5; }
-    if (PINB.3 == 0) { delay_ms(10); i = 6; }
-    PORTB.5 = 1;
-          
-    PORTB.6 = 0;
-    if (PINB.0 == 0) { delay_ms(10); i = 7; }
-    if (PINB.1 == 0) { delay_ms(10); i = 8; }
-    if (PINB.3 == 0) { delay_ms(10); i = 9; }
-    PORTB.6 = 1;
-          
-    PORTB.7 = 0; 
-    if (PINB.0 == 0) { delay_ms(10); i = KEYPAD_STAR; }
-    if (PINB.1 == 0) { delay_ms(10); i = 0; }
-    if (PINB.3 == 0) { delay_ms(10); i = KEYPAD_SQUARE; }
-    PORTB.7 = 1;
-          
-    return i;
+void alert_task() {
+    update_temper_led();
+    calendar_update();
 }
 
+void sensor_task() {
+    struct ClockSnapshot snap;
 
-void main(void) {
-    init();
-    // Global enable interrupts
-    
-    #asm("sei")
+    update_temper();
 
-    while (1) {
-        show_date_temp();
-        delay_ms(50);
-        
-        show_alarm(0, 1);
-        delay_ms(50);
-        
-        if (temper_int == true) {
-            set_temper_int();
-            temper_int = false;
-                                
-            lcd_clear();
-            delay_ms(30);
-        }
-        else if (time_int == true) {
-            set_time_alarm_int();
-            time_int = false;
-                                
-            lcd_clear();
-            delay_ms(30);
+    if (scan_primed & (1<<SCAN_INDOOR)) {
+        clock_snapshot(&snap);
+        if (snap.date.day != today_day) { // a new day, or the first reading
+            today_day = snap.date.day;
+            today_min_x10 = temper.current_x10;
+            today_max_x10 = temper.current_x10;
         }
-        else if (date_int == true) {
-            set_date_int();
-            date_int = false;
-                                
-            lcd_clear();
-            delay_ms(30);
+        else if (temper.current_x10 < today_min_x10)
+            today_min_x10 = temper.current_x10;
+        else if (temper.current_x10 > today_max_x10)
+            today_max_x10 = temper.current_x10;
+    }
+
+    trend_count++;
+    if (trend_count == TREND_INTERVAL) {
+        trend_count = 0;
+        update_trend();
+    }
+}
+
+void display_task() {
+    struct ClockSnapshot snap;
+
+    if (menu_open || display_hold_timer.armed) // a menu or a message owns the lcd
+        return;
+
+    show_date_temp();
+    if (watch_mode != WATCH_OFF) {
+        show_watch();
+        page_shown = PAGE_NONE;
+        return;
+    }
+
+    clock_snapshot(&snap);
+    page_update(&snap);
+}
+
+void alarm_task() {
+    if (alarm_beep) {
+        alarm_beep = false;
+        buzzer_beep(20);
+    }
+}
+
+void power_task() {
+    power_stats.idle_percent = power_stats.idle_counts / (10L * TIMER2_COUNTS_PER_MS);
+    power_stats.adc_percent = power_stats.adc_us / 10000L;
+
+    power_stats.idle_ms += power_stats.idle_counts / TIMER2_COUNTS_PER_MS;
+    power_stats.adc_ms += power_stats.adc_us / 1000;
+
+    // the part below 1ms is carried over to the next second
+    power_stats.idle_counts %= TIMER2_COUNTS_PER_MS;
+    power_stats.adc_us %= 1000;
+}
+
+unsigned long power_stamp() {
+    // now, in timer2 counts
+    unsigned int ticks;
+    unsigned char count;
+
+    do {
+        ticks = sys_ticks;
+        count = TCNT2;
+    } while (ticks != sys_ticks);
+
+    return (unsigned long)ticks * TIMER2_COUNTS_PER_MS + count;
+}
+
+void power_sleep(unsigned char mode) {
+    // SE is only set around the sleep instruction, so a stray sleep can't stop the cpu
+    unsigned long start = power_stamp();
+    unsigned long end;
+
+    SLEEP_CONTROL = (SLEEP_CONTROL & ~((1<<SM2) | (1<<SM1) | (1<<SM0))) | mode | (1<<SE);
+    SLEEP();
+    SLEEP_CONTROL &= ~(1<<SE);
+
+    // the stamp wraps with sys_ticks every 65.536s, mostly while we sleep
+    end = power_stamp();
+    if (end < start)
+        end += 65536L * TIMER2_COUNTS_PER_MS;
+    power_stats.idle_counts += end - start;
+}
+
+void main_screen_key(int key) {
+    char lcd_output[17];
+
+    if (watch_mode != WATCH_OFF) {
+        watch_key(key);
+        return;
+    }
+
+    if (key == 0) {
+        show_power_stats();
+    }
+#ifdef PPS_INPUT
+    else if (key == 1) {
+        show_pps_stats();
+    }
+#endif
+    else if (key == 4) {
+        watch_start(WATCH_STOPWATCH);
+    }
+    else if (key == 7) {
+        watch_start(WATCH_COUNTDOWN);
+    }
+#ifdef TRACE_RECORD
+    else if (key == 3) {
+        trace_dump();
+    }
+#endif
+#ifdef THERMOSTAT
+    else if (key == 6) {
+        show_thermostat();
+    }
+#endif
+    else if (key == 9) {
+        page_runs = PAGE_RUNS; // the next page on display_task's next run
+    }
+    else if (key == 2 || key == 8 || key == 5) { // 2: brighter, 8: dimmer, 5: back to automatic
+        if (key == 2 && brightness < BRIGHTNESS_LEVELS - 1)
+            set_brightness(brightness + 1);
+        else if (key == 8 && brightness > 0)
+            set_brightness(brightness - 1);
+
+#ifdef LIGHT_SENSOR_CHANNEL
+        brightness_auto = (key == 5);
+#endif
+
+        lcd_clear();
+        sprintf(lcd_output, "Brightness: %d", brightness + 1);
+        lcd_puts(lcd_output);
+        if (brightness_auto) {
+            lcd_gotoxy(0, 1);
+            lcd_puts("auto");
         }
+        hold_display(1000);
+    }
+}
+
+void watch_task() {
+    unsigned long cs;
+    unsigned char seq;
+
+    if (watch_mode == WATCH_OFF)
+        return;
+
+    if (watch_done) {
+        watch_done = false;
+        buzzer_beep(1000);
+    }
+
+    do {
+        seq = watch_seq;
+        MEMORY_BARRIER();
+        cs = watch_cs;
+        MEMORY_BARRIER();
+    } while ((seq & 1) || seq != watch_seq); // a tick or a button came in between
+    watch_digits(cs, watch_show);
+}
+
+void watch_key(int key) {
+    // '*' leaves the mode, 1 to WATCH_LAPS show that lap of the stopwatch
+    char lcd_output[17];
+    char temp[12];
+    unsigned char count = watch_lap_count;
+    unsigned long split;
+    unsigned long previous;
+    unsigned char seq;
+
+    if (key == KEYPAD_STAR) {
+        watch_mode = WATCH_OFF; // stops the count too, it only runs in a mode
+        watch_running = false;
+        return;
+    }
+
+    if (watch_mode != WATCH_STOPWATCH || key < 1 || key > WATCH_LAPS || key > count)
+        return;
+
+    // the ring keeps the last WATCH_LAPS laps, key 1 is the oldest of them
+    key += count > WATCH_LAPS ? count - WATCH_LAPS : 0;
+    do {
+        seq = watch_seq;
+        MEMORY_BARRIER();
+        split = watch_laps[(key - 1) % WATCH_LAPS];
+        previous = key > 1 ? watch_laps[(key - 2) % WATCH_LAPS] : 0;
+        MEMORY_BARRIER();
+    } while ((seq & 1) || seq != watch_seq);
+
+    lcd_clear();
+    format_watch(temp, split);
+    sprintf(lcd_output, "Lap%d %s", key, temp);
+    lcd_puts(lcd_output);
+    format_watch(temp, split - previous);
+    sprintf(lcd_output, "+%s", temp);
+    lcd_gotoxy(0, 1);
+    lcd_puts(lcd_output);
+    hold_display(2000);
+}
+
+void watch_start(unsigned char mode) {
+    // the countdown asks for its mm:ss first, '#' takes it and '*' goes back
+    int digits[4];
+    int count = 0;
+    int kp_input;
+    unsigned char sreg;
+
+    if (mode == WATCH_COUNTDOWN) {
+        menu_open = true;
+        menu_opened++;
+        lcd_clear();
+        lcd_puts("Countdown --:--");
+        lcd_gotoxy(0, 1);
+        lcd_puts("#:Start *:Cancel");
+
+        while (1) {
+            kp_input = ui_get_key();
+            if (kp_input == KEYPAD_STAR) {
+                menu_open = false;
+                lcd_clear();
+                return;
+            }
+            if (kp_input == KEYPAD_SQUARE && count == 4)
+                break;
+            if (kp_input > 9 || count == 4 || (count == 2 && kp_input > 5))
+                continue;
+
+            digits[count] = kp_input;
+            lcd_gotoxy(count < 2 ? 10 + count : 11 + count, 0);
+            lcd_putchar('0' + kp_input);
+            count++;
+        }
+        menu_open = false;
+
+        watch_preset = ((digits[0] * 10 + digits[1]) * 60L + digits[2] * 10 + digits[3]) * 100;
+        if (watch_preset == 0) {
+            lcd_clear();
+            return;
+        }
+    }
+
+    sreg = SREG;
+    CLI();
+    watch_running = false;
+    watch_cs = mode == WATCH_COUNTDOWN ? watch_preset : 0;
+    watch_ms = 0;
+    watch_lap_count = 0;
+    watch_done = false;
+    watch_mode = mode;
+    SREG = sreg; // the interrupts as the caller had them
+
+    watch_digits(mode == WATCH_COUNTDOWN ? watch_preset : 0, watch_show);
+
+    lcd_clear();
+    show_date_temp();
+    show_watch();
+}
+
+bool watch_button(unsigned char type) {
+    // isr only, so a start or stop lands within one timer2 tick whatever the main loop does.
+    // time button: start/stop, date button: lap while running, reset while stopped.
+    // false leaves the button to its menu.
+    if (type == EVENT_BUTTON_TIME) {
+        if (watch_running)
+            watch_running = false;
+        else if (watch_mode == WATCH_STOPWATCH || watch_cs > 0)
+            watch_running = true;
+        return true;
+    }
+
+    if (type == EVENT_BUTTON_DATE) {
+        watch_seq++;
+        if (!watch_running) {
+            watch_cs = watch_mode == WATCH_COUNTDOWN ? watch_preset : 0;
+            watch_ms = 0;
+            watch_lap_count = 0;
+        }
+        else if (watch_mode == WATCH_STOPWATCH && watch_lap_count < 255) {
+            // past 255 laps the count can't follow the ring, so no more are taken
+            watch_laps[watch_lap_count % WATCH_LAPS] = watch_cs;
+            watch_lap_count++;
+        }
+        watch_seq++;
+        return true;
+    }
+
+    return false;
+}
+
+void watch_digits(unsigned long cs, int digits[3][2]) {
+    unsigned long secs = cs / 100;
+    unsigned int pair[3];
+    unsigned char i;
+
+    if (secs < 3600) {
+        pair[0] = secs / 60;
+        pair[1] = secs % 60;
+        pair[2] = cs % 100;
+    }
+    else {
+        pair[0] = secs / 3600;
+        pair[1] = (secs / 60) % 60;
+        pair[2] = secs % 60;
+    }
+
+    for (i = 0; i < 3; i++) {
+        digits[i][0] = pair[i] / 10;
+        digits[i][1] = pair[i] % 10;
+    }
+}
+
+void format_watch(char *out, unsigned long cs) {
+    // 01:23.45, from an hour on 01:02:03
+    int digits[3][2];
+
+    watch_digits(cs, digits);
+    sprintf(out, cs < 360000 ? "%d%d:%d%d.%d%d" : "%d%d:%d%d:%d%d", digits[0][0], digits[0][1],
+            digits[1][0], digits[1][1], digits[2][0], digits[2][1]);
+}
+
+void show_watch() {
+    // second line while a mode is on
+    char lcd_output[17];
+    unsigned int secs = watch_preset / 100;
+    unsigned char count = watch_lap_count; // once, the date button's isr can take a lap in between
+
+    if (watch_mode == WATCH_STOPWATCH)
+        sprintf(lcd_output, "Stopwatch Laps:%d", count > 9 ? 9 : count);
+    else
+        sprintf(lcd_output, "Countdown %d%d:%d%d", secs / 600, (secs / 60) % 10, (secs % 60) / 10, secs % 10);
+    pad_line(lcd_output);
+    lcd_gotoxy(0, 1);
+    lcd_puts(lcd_output);
+}
+
+void set_brightness(unsigned char level) {
+    brightness = level;
+    OCR0 = TIMER0_START + brightness_on_time[level]; // one byte, the isr sees the old or the new one
+}
+
+void light_task() {
+#ifdef LIGHT_SENSOR_CHANNEL
+    int light;
+    unsigned char level = 0;
+    unsigned char border;
+
+    if (!brightness_auto || !(scan_primed & (1<<SCAN_LIGHT)))
+        return;
+
+    light = scan_value(SCAN_LIGHT) >> 4; // already smoothed by the scanner
+
+    while (level < BRIGHTNESS_LEVELS - 1 && light >= light_thresholds[level])
+        level++;
+
+    if (level == brightness)
+        return;
+
+    // only move once the reading is clearly past the threshold, so it doesn't flicker on it
+    border = level > brightness ? level - 1 : level;
+    if (abs(light - light_thresholds[border]) > LIGHT_HYSTERESIS)
+        set_brightness(level);
+#endif
+}
+
+void scanner_task() {
+    unsigned int value = read_adc(scan_channels[scan_next].mux) << 4;
+
+    if (scan_primed & (1<<scan_next)) {
+        if (value > scan_values[scan_next])
+            scan_values[scan_next] += (value - scan_values[scan_next]) >> scan_channels[scan_next].smooth;
+        else
+            scan_values[scan_next] -= (scan_values[scan_next] - value) >> scan_channels[scan_next].smooth;
+    }
+    else {
+        scan_values[scan_next] = value;
+        scan_primed |= (1<<scan_next);
+    }
+
+#ifdef OUTDOOR_ADC_CHANNEL
+    if (scan_next == SCAN_OUTDOOR)
+        temper_outdoor_x10 = sensor_to_temper((scan_values[SCAN_OUTDOOR] + 8) >> 4);
+#endif
+
+#ifndef POWER_FAIL_COMPARATOR
+    if (scan_next == SCAN_SUPPLY && (value >> 4) > POWER_FAIL_BANDGAP) { // the raw reading, no time to smooth
+        CLI();
+        power_fail();
+    }
+#endif
+
+    scan_next++;
+    if (scan_next == SCAN_CHANNELS)
+        scan_next = 0;
+}
+
+unsigned int scan_value(unsigned char channel) {
+    // smoothed reading x16
+    return scan_values[channel];
+}
+
+unsigned int supply_mv() {
+    unsigned int bandgap = scan_values[SCAN_SUPPLY] >> 4;
+
+    if (bandgap == 0)
+        return 0;
+
+    return (unsigned long)BANDGAP_MV * 1024 / bandgap;
+}
+
+void show_power_stats() {
+    char lcd_output[17];
+    unsigned int vcc;
+
+    lcd_clear();
+
+    sprintf(lcd_output, "Idle:%d%% ADC:%d%%", power_stats.idle_percent, power_stats.adc_percent);
+    lcd_gotoxy(0, 0);
+    lcd_puts(lcd_output);
+
+    vcc = supply_mv();
+    sprintf(lcd_output, "Slp:%um %u.%u%uV", (unsigned int)(power_stats.idle_ms / 60000),
+            vcc / 1000, (vcc % 1000) / 100, (vcc % 100) / 10);
+    lcd_gotoxy(0, 1);
+    lcd_puts(lcd_output);
+
+    hold_display(3000);
+}
+
+#ifdef PPS_INPUT
+void pps_task() {
+    // keeps the learned rate for the next start: hourly while locked, and once when the
+    // reference goes away. small changes aren't worth an eeprom write.
+    unsigned long period;
+    long change;
+    unsigned char seq;
+
+    if (pps.state == PPS_LOCKED) {
+        pps_save_wait++;
+        if (pps_save_wait < PPS_SAVE_INTERVAL)
+            return;
+    }
+    else if (pps.state != PPS_HOLDOVER || pps_save_wait == 0)
+        return;
+    pps_save_wait = 0;
+
+    do {
+        seq = clock_seq;
+        MEMORY_BARRIER();
+        period = clock_period;
+        MEMORY_BARRIER();
+    } while ((seq & 1) || seq != clock_seq); // a pulse came in between
+
+    change = period - EE_READ_DWORD(&clock_period_saved);
+    if (labs(change) > 8) // 1ppm
+        EE_WRITE_DWORD(&clock_period_saved, period);
+}
+
+void show_pps_stats() {
+    // PPS:Lock -96us
+    // Drift:-12.5ppm
+    char lcd_output[17];
+    char temp[8];
+    unsigned char state;
+    int offset;
+    long drift;
+    long us;
+    unsigned char seq;
+
+    do {
+        seq = clock_seq;
+        MEMORY_BARRIER();
+        state = pps.state;
+        offset = pps.offset;
+        drift = clock_period - CLOCK_PERIOD_NOMINAL; // 1/256 count a second is 0.125ppm
+        MEMORY_BARRIER();
+    } while ((seq & 1) || seq != clock_seq);
+
+    lcd_clear();
+
+    if (state == PPS_NONE)
+        lcd_puts("PPS:None");
+    else {
+        // up to 5 characters for the number: us below 10ms, ms above
+        us = offset * 32L;
+        if (labs(us) <= 9999)
+            sprintf(lcd_output, "PPS:%s %dus", state == PPS_LOCKED ? "Lock" : "Hold", (int)us);
+        else
+            sprintf(lcd_output, "PPS:%s %dms", state == PPS_LOCKED ? "Lock" : "Hold", (int)(us / 1000));
+        lcd_puts(lcd_output);
+    }
+
+    // the period is accepted within 1%, 10000ppm: tenths only below 1000ppm
+    if (labs(drift) < 8000)
+        format_x10(temp, (int)(drift * 10 / 8));
+    else
+        sprintf(temp, "%d", (int)(drift / 8));
+    sprintf(lcd_output, "Drift:%sppm", temp);
+    lcd_gotoxy(0, 1);
+    lcd_puts(lcd_output);
+
+    hold_display(3000);
+}
+#endif
+
+#ifdef RTC_CHIP
+void rtc_task() {
+    // runs within 50ms of the square wave edge, so the rtc is well inside the second
+    // our clock is in. a tick between the two reads shows in clock_seq and it's tried again.
+    struct ClockSnapshot snap;
+    struct Time rtc_time;
+    struct Date rtc_date;
+    unsigned char seq;
+
+    if (!rtc_ticked)
+        return;
+    rtc_ticked = false;
+
+    if (rtc_write_due) {
+        if (pending_time || pending_date) // not applied yet, the next tick does it
+            return;
+        // writing the seconds restarts the rtc's countdown, so its next edge comes one
+        // second from now, as our second would
+        clock_snapshot(&snap);
+        if (rtc_write(&snap.time, &snap.date))
+            rtc_write_due = false;
+        rtc_resync_wait = 0;
+        return;
+    }
+
+    rtc_resync_wait++;
+    if (rtc_resync_wait < RTC_RESYNC_SECONDS)
+        return;
+
+    seq = clock_seq;
+    if (!rtc_read(&rtc_time, &rtc_date))
+        return; // try again next second
+    clock_snapshot(&snap);
+    if (seq != clock_seq || (rtc_time.sec[0] == 5 && rtc_time.sec[1] == 9))
+        return; // a tick came in between, or the second after this one is in another minute
+    rtc_resync_wait = 0;
+
+    if (memcmp(&rtc_time, &snap.time, sizeof(rtc_time)) != 0) {
+        // a published time shows from the next tick on, so one second ahead
+        rtc_time.sec[1]++;
+        if (rtc_time.sec[1] == 10) {
+            rtc_time.sec[1] = 0;
+            rtc_time.sec[0]++;
+        }
+        publish_time(&rtc_time);
+    }
+    if (memcmp(&rtc_date, &snap.date, sizeof(rtc_date)) != 0)
+        publish_date(&rtc_date);
+}
+
+void rtc_start() {
+    // called from init(), before the interrupts are on
+    unsigned char control;
+    int year = date.year;
+
+    // TWI initialization
+    // Bit Rate: 100.000 kHz
+    TWSR=0x00;
+    TWBR=0x20;
+    TWCR=(1<<TWEN);
+
+    // square wave output at 1Hz
+#if RTC_CHIP == RTC_DS1307
+    control = 0x10; // SQWE
+    rtc_write_regs(0x07, &control, 1);
+#else
+    control = 0x00; // INTCN off: square wave, RS2:1 = 0: 1Hz
+    rtc_write_regs(0x0E, &control, 1);
+#endif
+
+    if (!rtc_read(&time, &date)) // stopped or never set: it starts from our time
+        rtc_write(&time, &date);
+    else if (date.year != year)
+        dst_ended = false; // restored for another year
+}
+
+bool rtc_read(struct Time *t, struct Date *d) {
+    unsigned char reg[7];
+    int year, month, day;
+
+#if RTC_CHIP == RTC_DS3231
+    unsigned char status;
+
+    if (!rtc_read_regs(0x0F, &status, 1) || (status & 0x80)) // OSF: the oscillator stopped
+        return false;
+#endif
+    if (!rtc_read_regs(0x00, reg, 7))
+        return false;
+    if (reg[0] & 0x80) // DS1307 CH: the oscillator is stopped
+        return false;
+
+    // bcd, with the 24 hour mode the tens of hours are two bits
+    year = 2000 + (reg[6] >> 4) * 10 + (reg[6] & 0x0F);
+    month = ((reg[5] >> 4) & 0x01) * 10 + (reg[5] & 0x0F); // DS3231 keeps the century in bit 7
+    day = ((reg[4] >> 4) & 0x03) * 10 + (reg[4] & 0x0F);
+    if (month < 1 || month > 12 || day < 1 || day > 31 || (reg[2] & 0x40))
+        return false;
+
+    t->sec[0] = (reg[0] >> 4) & 0x07;
+    t->sec[1] = reg[0] & 0x0F;
+    t->min[0] = (reg[1] >> 4) & 0x07;
+    t->min[1] = reg[1] & 0x0F;
+    t->hour[0] = (reg[2] >> 4) & 0x03;
+    t->hour[1] = reg[2] & 0x0F;
+    gregorian_to_jalali(year, month, day, &d->year, &d->month, &d->day);
+
+    return true;
+}
+
+bool rtc_write(struct Time *t, struct Date *d) {
+    unsigned char reg[7];
+    int year, month, day;
+    int y;
+
+    jalali_to_gregorian(d->year, d->month, d->day, &year, &month, &day);
+    y = month < 3 ? year - 1 : year;
+
+    reg[0] = (t->sec[0] << 4) | t->sec[1]; // CH cleared, the oscillator runs
+    reg[1] = (t->min[0] << 4) | t->min[1];
+    reg[2] = (t->hour[0] << 4) | t->hour[1]; // 24 hour mode
+    reg[3] = (y + y / 4 - y / 100 + y / 400 + weekday_offset[month - 1] + day) % 7 + 1; // 1: sunday
+    reg[4] = ((day / 10) << 4) | (day % 10);
+    reg[5] = ((month / 10) << 4) | (month % 10);
+    reg[6] = (((year % 100) / 10) << 4) | (year % 10);
+
+    if (!rtc_write_regs(0x00, reg, 7))
+        return false;
+#if RTC_CHIP == RTC_DS3231
+    reg[0] = 0x00; // clears OSF, the 32kHz output is off
+    rtc_write_regs(0x0F, reg, 1);
+#endif
+    return true;
+}
+
+bool rtc_read_regs(unsigned char first, unsigned char *buf, unsigned char count) {
+    bool ok = twi_start(RTC_ADDRESS) && twi_write(first) && twi_start(RTC_ADDRESS | 1);
+
+    while (ok && count--)
+        *buf++ = twi_read(count != 0); // the last byte is not acknowledged
+    twi_stop();
+
+    return ok;
+}
+
+bool rtc_write_regs(unsigned char first, unsigned char *buf, unsigned char count) {
+    bool ok = twi_start(RTC_ADDRESS) && twi_write(first);
+
+    while (ok && count--)
+        ok = twi_write(*buf++);
+    twi_stop();
+
+    return ok;
+}
+
+bool twi_start(unsigned char address) {
+    // start (or repeated start) and the address, true if the chip answered
+    unsigned char status;
+
+    TWCR = (1<<TWINT) | (1<<TWSTA) | (1<<TWEN);
+    if (!twi_wait())
+        return false;
+    status = TWSR & 0xF8;
+    if (status != 0x08 && status != 0x10)
+        return false;
+
+    TWDR = address;
+    TWCR = (1<<TWINT) | (1<<TWEN);
+    if (!twi_wait())
+        return false;
+    status = TWSR & 0xF8;
+
+    return status == 0x18 || status == 0x40; // SLA+W or SLA+R acknowledged
+}
+
+bool twi_write(unsigned char data) {
+    TWDR = data;
+    TWCR = (1<<TWINT) | (1<<TWEN);
+
+    return twi_wait() && (TWSR & 0xF8) == 0x28; // data acknowledged
+}
+
+unsigned char twi_read(bool ack) {
+    TWCR = (1<<TWINT) | (1<<TWEN) | (ack ? (1<<TWEA) : 0);
+    twi_wait();
+
+    return TWDR;
+}
+
+void twi_stop() {
+    TWCR = (1<<TWINT) | (1<<TWSTO) | (1<<TWEN);
+}
+
+bool twi_wait() {
+    // a missing or stuck rtc must not hang the clock
+    unsigned int n = TWI_TIMEOUT;
+
+    while (!(TWCR & (1<<TWINT)))
+        if (--n == 0)
+            return false;
+
+    return true;
+}
+
+void gregorian_to_jalali(int gy, int gm, int gd, int *jy, int *jm, int *jd) {
+    // counts the days, then takes the 33 year cycles (12053 days) and 4 year groups out
+    int gy2 = gm > 2 ? gy + 1 : gy;
+    long days = 355666L + 365L * gy + (gy2 + 3) / 4 - (gy2 + 99) / 100 + (gy2 + 399) / 400 + gd + gregorian_month_start[gm - 1];
+
+    *jy = -1595 + 33 * (int)(days / 12053);
+    days %= 12053;
+    *jy += 4 * (int)(days / 1461);
+    days %= 1461;
+    if (days > 365) {
+        *jy += (int)((days - 1) / 365);
+        days = (days - 1) % 365;
+    }
+
+    if (days < 186) { // the first six months have 31 days
+        *jm = 1 + (int)(days / 31);
+        *jd = 1 + (int)(days % 31);
+    }
+    else {
+        *jm = 7 + (int)((days - 186) / 30);
+        *jd = 1 + (int)((days - 186) % 30);
+    }
+}
+
+void jalali_to_gregorian(int jy, int jm, int jd, int *gy, int *gm, int *gd) {
+    long days;
+    int length;
+
+    jy += 1595;
+    days = -355668L + 365L * jy + (jy / 33) * 8 + ((jy % 33) + 3) / 4 + jd + (jm < 7 ? (jm - 1) * 31 : (jm - 7) * 30 + 186);
+
+    *gy = 400 * (int)(days / 146097);
+    days %= 146097;
+    if (days > 36524) {
+        days--;
+        *gy += 100 * (int)(days / 36524);
+        days %= 36524;
+        if (days >= 365)
+            days++;
+    }
+    *gy += 4 * (int)(days / 1461);
+    days %= 1461;
+    if (days > 365) {
+        *gy += (int)((days - 1) / 365);
+        days = (days - 1) % 365;
+    }
+    *gd = (int)days + 1;
+
+    for (*gm = 1; *gm < 12; (*gm)++) {
+        length = gregorian_month_days[*gm - 1];
+        if (*gm == 2 && ((*gy % 4 == 0 && *gy % 100 != 0) || *gy % 400 == 0))
+            length = 29;
+        if (*gd <= length)
+            break;
+        *gd -= length;
+    }
+}
+#endif
+
+void timer_arm(struct SoftTimer *t, unsigned int ms) {
+    unsigned char slot;
+
+    if (t->armed)
+        timer_cancel(t);
+
+    if (ms == 0)
+        ms = 1;
+    t->expires = get_ticks() + ms;
+    slot = t->expires & (WHEEL_SLOTS - 1);
+
+    t->prev = 0;
+    t->next = wheel[slot];
+    if (wheel[slot] != 0)
+        wheel[slot]->prev = t;
+    wheel[slot] = t;
+    t->armed = true;
+}
+
+void timer_cancel(struct SoftTimer *t) {
+    if (!t->armed)
+        return;
+
+    if (t->prev != 0)
+        t->prev->next = t->next;
+    else
+        wheel[t->expires & (WHEEL_SLOTS - 1)] = t->next;
+
+    if (t->next != 0)
+        t->next->prev = t->prev;
+
+    t->armed = false;
+}
+
+void timer_wheel_run() {
+    // walks every tick since the last call, so a slow task only delays the timers, never loses them
+    unsigned int now = get_ticks();
+    struct SoftTimer *t;
+    struct SoftTimer *next;
+
+    while (wheel_now != now) {
+        wheel_now++;
+
+        t = wheel[wheel_now & (WHEEL_SLOTS - 1)];
+        while (t != 0) {
+            next = t->next;
+            if (t->expires == wheel_now) {
+                timer_cancel(t);
+                if (t->callback != 0)
+                    t->callback();
+            }
+            t = next;
+        }
+    }
+}
+
+void buzzer_beep(unsigned int ms) {
+    BUZZER_ON();
+    timer_arm(&buzzer_timer, ms);
+}
+
+void buzzer_off() {
+    BUZZER_OFF();
+}
+
+void hold_display(unsigned int ms) {
+    // keeps the message on the lcd for ms, without waiting for it
+    timer_arm(&display_hold_timer, ms);
+}
+
+void ui_wait(unsigned int ms) {
+    // for a menu that has to show something before going on, the other tasks keep running
+    timer_arm(&ui_wait_timer, ms);
+    while (ui_wait_timer.armed)
+        scheduler_run();
+}
+
+int ui_get_key() {
+    // a setting button pressed while a menu is open closes it, same as '*'
+    struct Event e;
+
+    while (!pop_event(&e))
+        scheduler_run();
+
+    if (e.type != EVENT_KEY)
+        return KEYPAD_STAR;
+
+    return e.key;
+}
+
+void push_event(unsigned char type, signed char key) {
+    // isr only
+    unsigned char next = (event_head + 1) & (EVENT_QUEUE_SIZE - 1);
+
+    if (next == event_tail) { // full, the oldest events are kept
+        events_dropped++;
+        return;
+    }
+
+    events[event_head].type = type;
+    events[event_head].key = key;
+    events[event_head].stamp = sys_ticks;
+    event_head = next; // publish only after the slot is filled
+}
+
+bool pop_event(struct Event *e) {
+    // main loop only
+    if (event_tail == event_head)
+        return false;
+
+    memcpy(e, &events[event_tail], sizeof(struct Event));
+    event_tail = (event_tail + 1) & (EVENT_QUEUE_SIZE - 1);
+
+    return true;
+}
+
+void button_edge(unsigned char type) {
+    // isr only: a falling edge on one of the setting buttons, or the same from a replay
+#ifdef TRACE_RECORD
+    trace_put(type, 0);
+#endif
+
+    if (type == EVENT_BUTTON_TIME && alarm_buzz)
+        alarm_buzz = false; // the display task redraws the alarm line
+    else
+        button_pressed(type);
+}
+
+void button_pressed(unsigned char type) {
+    // isr only. edges closer than BUTTON_LOCKOUT_MS to the last accepted one are contact bounce
+    unsigned char i = type - EVENT_BUTTON_TEMPER;
+
+    if (sys_ticks - button_accepted_at[i] < BUTTON_LOCKOUT_MS)
+        return;
+
+    button_accepted_at[i] = sys_ticks;
+    if (watch_mode != WATCH_OFF && watch_button(type))
+        return;
+    push_event(type, 0);
+}
+
+void pad_line(char *line) {
+    // fills the line with spaces up to the 16 lcd columns
+    unsigned char len = strlen(line);
+
+    while (len < 16)
+        line[len++] = ' ';
+    line[16] = 0;
+}
+
+void update_temper() {
+    int input;
+
+    if (!(scan_primed & (1<<SCAN_INDOOR)))
+        return; // nothing read yet
+
+    input = (scan_value(SCAN_INDOOR) + 8) >> 4;
+
+    temper.raw_x10 = sensor_to_temper(input);
+    temper.current_x10 = (int)(((long)temper.raw_x10 * cal_gain) >> 8) + cal_offset;
+
+    // rounded to whole degrees, half away from zero
+    if (temper.current_x10 < 0)
+        temper.current = (temper.current_x10 - 5) / 10;
+    else
+        temper.current = (temper.current_x10 + 5) / 10;
+}
+
+void update_trend() {
+    int rate;
+
+    if (!trend_primed) {
+        trend_last_x10 = temper.current_x10;
+        trend_primed = true;
+        return;
+    }
+
+    // 0.1C per interval to 0.01C per minute, a jump (sensor swapped, calibrated) is clipped
+    rate = (temper.current_x10 - trend_last_x10) * (600 / TREND_INTERVAL);
+    if (rate > 2000)
+        rate = 2000;
+    else if (rate < -2000)
+        rate = -2000;
+    trend_last_x10 = temper.current_x10;
+
+    trend_acc += rate - (trend_acc >> TREND_SMOOTH);
+    temper.trend = trend_acc >> TREND_SMOOTH;
+}
+
+void lcd_define_char(flash unsigned char *pattern, unsigned char code) {
+    unsigned char i;
+    unsigned char address = (code << 3) | 0x40; // character generator ram
+
+    for (i = 0; i < 8; i++)
+        lcd_write_byte(address++, *pattern++);
+}
+
+int sensor_to_temper(int adc) {
+    // returns 0.1C. outside the table the first or last segment is carried on
+    unsigned char lo = 0;
+    unsigned char hi = SENSOR_TABLE_SIZE - 1;
+    unsigned char mid;
+    int adc0, temper0;
+
+    while (hi - lo > 1) {
+        mid = (lo + hi) >> 1;
+        if (adc < sensor_table[mid].adc)
+            hi = mid;
+        else
+            lo = mid;
+    }
+
+    adc0 = sensor_table[lo].adc;
+    temper0 = sensor_table[lo].temper;
+
+    return temper0 + (int)((long)(adc - adc0) * (sensor_table[hi].temper - temper0) / (sensor_table[hi].adc - adc0));
+}
+
+void temper_calibrate(int raw, int ref) {
+    // raw: what the sensor reads, ref: the real temperature, both 0.1C.
+    // one point only shifts the reading, the two newest points set the slope as well
+    if (cal_points == 2) {
+        cal_raw[0] = cal_raw[1];
+        cal_ref[0] = cal_ref[1];
+        cal_points = 1;
+    }
+
+    if (cal_points == 0 || abs(raw - cal_raw[0]) < CAL_MIN_SPAN) {
+        cal_raw[0] = raw;
+        cal_ref[0] = ref;
+        cal_points = 1;
+
+        cal_gain = 256;
+        cal_offset = ref - raw;
+        return;
+    }
+
+    cal_raw[1] = raw;
+    cal_ref[1] = ref;
+    cal_points = 2;
+
+    cal_gain = ((long)(ref - cal_ref[0]) << 8) / (raw - cal_raw[0]);
+    cal_offset = cal_ref[0] - (int)(((long)cal_raw[0] * cal_gain) >> 8);
+}
+
+void format_x10(char *out, int value) {
+    // 0.1C as "-1.5"
+    if (value < 0) {
+        *out++ = '-';
+        value = -value;
+    }
+    sprintf(out, "%d.%d", value / 10, value % 10);
+}
+
+void set_temper_cal() {
+    // the user types the real temperature (whole C) while the sensor reading is kept
+    int kp_input = -1;
+    int input_len = 0;
+    int number = 0;
+    int raw = temper.raw_x10;
+    char lcd_output[17];
+    char temp[8];
+
+    lcd_clear();
+
+    format_x10(lcd_output, temper.current_x10);
+    strcat(lcd_output, "C Real:");
+    lcd_gotoxy(0, 0);
+    lcd_puts(lcd_output);
+
+    lcd_gotoxy(0, 1);
+    lcd_puts("*:Discard #:Save");
+
+    while(1) {
+        kp_input = ui_get_key();
+        if (0 <= kp_input && kp_input <= 9) {
+            number = number * 10 + kp_input;
+            input_len++;
+
+            sprintf(temp, "%d", number);
+            lcd_gotoxy(strlen(lcd_output), 0);
+            lcd_puts(temp);
+
+            if (input_len == 3)
+                break;
+        }
+        else if (kp_input == KEYPAD_STAR) {
+            return;
+        }
+        else if (kp_input == KEYPAD_SQUARE && input_len > 0) {
+            break;
+        }
+    }
+
+    temper_calibrate(raw, number * 10);
+
+    lcd_clear();
+    lcd_gotoxy(0, 0);
+    lcd_puts("Calibrated!");
+    lcd_gotoxy(0, 1);
+    if (cal_points == 2)
+        lcd_puts("2 points");
+    else
+        lcd_puts("1 point");
+    hold_display(300);
+}
+
+void update_temper_led() {
+    // the leds are written by show_time() in the timer0 isr, here we only pick the code
+    bool min_or_max = false;
+    long projected;
+    struct ClockSnapshot snap;
+
+    clock_snapshot(&snap);
+
+    if (snap.temper.current < snap.temper.min) {
+        led_code = 0; // PORTD.0 = 0, PORTD.1 = 0
+        
+        min_or_max = true;
+    }
+    else if (snap.temper.current > snap.temper.max) {
+        led_code = 2; // PORTD.0 = 0, PORTD.1 = 1
+        
+        min_or_max = true;
+    }
+    else {
+        led_code = 1; // PORTD.0 = 1, PORTD.1 = 0
+
+        temper_buzz_alowed = true;
+        min_or_max = false;
+    }
+
+    if (temper_buzz_alowed && min_or_max) {
+        buzzer_beep(100);
+
+        temper_buzz_alowed = false;
+    }
+
+    // early warning: still in the band, but the trend leaves it within TREND_WARN_MINUTES
+    projected = snap.temper.current_x10 + (long)snap.temper.trend * TREND_WARN_MINUTES / 10;
+    trend_warning = TREND_WARN_MINUTES > 0 && !min_or_max &&
+                    (projected > snap.temper.max * 10L || projected < snap.temper.min * 10L);
+
+    if (trend_warning && !trend_warned)
+        buzzer_beep(30); // shorter than the out of band beep
+    trend_warned = trend_warning;
+}
+
+#ifdef THERMOSTAT
+void thermostat_task() {
+    // once a second: the relay for this second of the window, and every THERMO_STEP_SECONDS
+    // a new duty from the temperature
+    struct ClockSnapshot snap;
+    bool want;
+
+    if (!(scan_primed & (1<<SCAN_INDOOR)))
+        return; // no temperature yet, the relay stays off
+
+    thermo_step_wait++;
+    if (thermo_step_wait >= THERMO_STEP_SECONDS || thermo_setpoint < 0) {
+        thermo_step_wait = 0;
+        clock_snapshot(&snap);
+        thermostat_step((snap.temper.min + snap.temper.max) * 5, snap.temper.current_x10);
+    }
+
+    want = (long)thermo_window * (THERMO_DUTY_MAX / THERMO_WINDOW_SECONDS) < thermo_duty;
+    thermo_window++;
+    if (thermo_window == THERMO_WINDOW_SECONDS)
+        thermo_window = 0;
+
+    if (thermo_relay_seconds < 0xFFFF)
+        thermo_relay_seconds++;
+    if (want == thermo_relay ||
+        thermo_relay_seconds < (thermo_relay ? THERMO_MIN_ON_SECONDS : THERMO_MIN_OFF_SECONDS))
+        return;
+
+    thermo_relay = want;
+    thermo_relay_seconds = 0;
+    if (want)
+        RELAY_ON();
+    else
+        RELAY_OFF();
+}
+
+void thermostat_step(int setpoint, int input) {
+    // the same few multiplies every step, whatever the temperature does
+    int error = setpoint - input;
+    int change = input - thermo_last_x10;
+#if THERMOSTAT != THERMO_HYSTERESIS
+    long out;
+#endif
+
+    if (thermo_setpoint < 0)
+        change = 0; // first step, nothing to take a difference from
+    thermo_setpoint = setpoint;
+    thermo_last_x10 = input;
+
+#ifdef THERMO_COOLING
+    error = -error;
+    change = -change;
+#endif
+    if (error > THERMO_ERROR_MAX)
+        error = THERMO_ERROR_MAX;
+    else if (error < -THERMO_ERROR_MAX)
+        error = -THERMO_ERROR_MAX;
+    if (change > THERMO_ERROR_MAX)
+        change = THERMO_ERROR_MAX;
+    else if (change < -THERMO_ERROR_MAX)
+        change = -THERMO_ERROR_MAX;
+
+#if THERMOSTAT == THERMO_HYSTERESIS
+    if (error > THERMO_HYSTERESIS_X10)
+        thermo_duty = THERMO_DUTY_MAX;
+    else if (error < -THERMO_HYSTERESIS_X10)
+        thermo_duty = 0;
+#else
+    out = ((long)THERMO_KP * error + thermo_integral - (long)THERMO_KD * change) >> 8;
+
+    // anti-windup: the integral stops where the output is already at the end it pushes to
+    if (!(out >= THERMO_DUTY_MAX && error > 0) && !(out <= 0 && error < 0)) {
+        thermo_integral += (long)THERMO_KI * error;
+        if (thermo_integral > (long)THERMO_DUTY_MAX << 8)
+            thermo_integral = (long)THERMO_DUTY_MAX << 8;
+        else if (thermo_integral < 0)
+            thermo_integral = 0;
+    }
+
+    if (out > THERMO_DUTY_MAX)
+        out = THERMO_DUTY_MAX;
+    else if (out < 0)
+        out = 0;
+
+    // on or off times shorter than the relay's minimum become none, or all of the window
+    if (out < THERMO_MIN_ON_SECONDS * (THERMO_DUTY_MAX / THERMO_WINDOW_SECONDS))
+        out = 0;
+    else if (out > THERMO_DUTY_MAX - THERMO_MIN_OFF_SECONDS * (THERMO_DUTY_MAX / THERMO_WINDOW_SECONDS))
+        out = THERMO_DUTY_MAX;
+    thermo_duty = out;
+#endif
+}
+
+void show_thermostat() {
+    char lcd_output[17];
+    char temp[8];
+
+    lcd_clear();
+
+    if (thermo_setpoint < 0) {
+        lcd_puts("Thermostat: wait");
+        hold_display(2000);
+        return;
+    }
+
+    format_x10(temp, thermo_setpoint);
+    sprintf(lcd_output, "Set:%sC", temp);
+    lcd_gotoxy(0, 0);
+    lcd_puts(lcd_output);
+
+    format_x10(temp, temper.current_x10);
+    sprintf(lcd_output, "%sC %d%% %s", temp, thermo_duty / 10, thermo_relay ? "on" : "off");
+    lcd_gotoxy(0, 1);
+    lcd_puts(lcd_output);
+
+    hold_display(3000);
+}
+#endif
+
+int keypad_scan()
+{
+    int i = -1;
+    
+    BIT_CLEAR(KEY_ROW_PORT, KEY_ROW0);
+    if (BIT_IS_CLEAR(KEY_COL_PIN, KEY_COL0)) i = 1;
+    if (BIT_IS_CLEAR(KEY_COL_PIN, KEY_COL1)) i = 2;
+    if (BIT_IS_CLEAR(KEY_COL_PIN, KEY_COL2)) i = 3;
+    BIT_SET(KEY_ROW_PORT, KEY_ROW0);
+          
+    BIT_CLEAR(KEY_ROW_PORT, KEY_ROW1);
+    if (BIT_IS_CLEAR(KEY_COL_PIN, KEY_COL0)) i = 4;
+    if (BIT_IS_CLEAR(KEY_COL_PIN, KEY_COL1)) i = 5;
+    if (BIT_IS_CLEAR(KEY_COL_PIN, KEY_COL2)) i = 6;
+    BIT_SET(KEY_ROW_PORT, KEY_ROW1);
+          
+    BIT_CLEAR(KEY_ROW_PORT, KEY_ROW2);
+    if (BIT_IS_CLEAR(KEY_COL_PIN, KEY_COL0)) i = 7;
+    if (BIT_IS_CLEAR(KEY_COL_PIN, KEY_COL1)) i = 8;
+    if (BIT_IS_CLEAR(KEY_COL_PIN, KEY_COL2)) i = 9;
+    BIT_SET(KEY_ROW_PORT, KEY_ROW2);
+          
+    BIT_CLEAR(KEY_ROW_PORT, KEY_ROW3);
+    if (BIT_IS_CLEAR(KEY_COL_PIN, KEY_COL0)) i = KEYPAD_STAR;
+    if (BIT_IS_CLEAR(KEY_COL_PIN, KEY_COL1)) i = 0;
+    if (BIT_IS_CLEAR(KEY_COL_PIN, KEY_COL2)) i = KEYPAD_SQUARE;
+    BIT_SET(KEY_ROW_PORT, KEY_ROW3);
+          
+    return i;
+}
+
+void keypad_update()
+{
+    // called from the timer2 isr every KEYPAD_SCAN_MS. a key is queued once, when the scan
+    // has read the same key for KEYPAD_DEBOUNCE_MS
+    int scan = keypad_scan();
+
+    if (scan != key_last_scan) {
+        key_last_scan = scan;
+        key_changed_at = sys_ticks;
+        return;
+    }
+
+    if (scan != key_stable && sys_ticks - key_changed_at >= KEYPAD_DEBOUNCE_MS) {
+        key_stable = scan;
+        if (scan != -1) {
+#ifdef TRACE_RECORD
+            trace_put(EVENT_KEY, scan);
+#endif
+            push_event(EVENT_KEY, scan);
+        }
+    }
+}
+
+#if defined(TRACE_RECORD) || defined(TRACE_REPLAY)
+void trace_start() {
+    // from init(), before the interrupts are on
+#ifdef TRACE_RECORD
+    // the header: what the recorded session starts from
+    trace_buf[0] = 'T';
+    trace_buf[1] = TRACE_VERSION;
+    trace_buf[2] = time.hour[0] * 10 + time.hour[1];
+    trace_buf[3] = time.min[0] * 10 + time.min[1];
+    trace_buf[4] = time.sec[0] * 10 + time.sec[1];
+    trace_buf[5] = date.year & 0xFF;
+    trace_buf[6] = date.year >> 8;
+    trace_buf[7] = date.month;
+    trace_buf[8] = date.day;
+    trace_buf[9] = alarm.atime.hour[0] * 10 + alarm.atime.hour[1];
+    trace_buf[10] = alarm.atime.min[0] * 10 + alarm.atime.min[1];
+    trace_buf[11] = alarm.on;
+    trace_buf[12] = temper.min;
+    trace_buf[13] = temper.max;
+    trace_buf[14] = pin & 0xFF;
+    trace_buf[15] = pin >> 8;
+    trace_len = TRACE_HEADER_SIZE;
+#else
+    unsigned char i;
+
+    GICR &= ~((1<<INT1) | (1<<INT0) | (1<<INT2)); // the trace stands in for the buttons
+
+    for (i = 0; i < 2; i++) {
+        memset(trace_lcd[i], ' ', LCD_COLUMNS);
+        trace_lcd[i][LCD_COLUMNS] = 0;
+    }
+
+    if (trace_data[0] != 'T' || trace_data[1] != TRACE_VERSION) {
+        trace_pos = sizeof(trace_data); // nothing to replay, the report says so
+        return;
+    }
+
+    time.hour[0] = trace_data[2] / 10;
+    time.hour[1] = trace_data[2] % 10;
+    time.min[0] = trace_data[3] / 10;
+    time.min[1] = trace_data[3] % 10;
+    time.sec[0] = trace_data[4] / 10;
+    time.sec[1] = trace_data[4] % 10;
+    date.year = trace_data[5] | (trace_data[6] << 8);
+    date.month = trace_data[7];
+    date.day = trace_data[8];
+    alarm.atime.hour[0] = trace_data[9] / 10;
+    alarm.atime.hour[1] = trace_data[9] % 10;
+    alarm.atime.min[0] = trace_data[10] / 10;
+    alarm.atime.min[1] = trace_data[10] % 10;
+    alarm.atime.sec[0] = 0;
+    alarm.atime.sec[1] = 0;
+    alarm.on = trace_data[11];
+    temper.min = (signed char)trace_data[12];
+    temper.max = (signed char)trace_data[13];
+    pin = trace_data[14] | (trace_data[15] << 8);
+
+    trace_pos = TRACE_HEADER_SIZE;
+    trace_wait = trace_next_delta();
+#endif
+}
+
+void trace_tick() {
+    // timer2 isr, every ms
+#ifdef TRACE_RECORD
+    trace_gap++;
+    if (trace_gap == TRACE_GAP_MAX) // a long quiet stretch is carried by empty records
+        trace_put(TRACE_GAP, 0);
+#else
+    unsigned char code;
+
+    trace_seq++;
+    trace_ms++;
+    trace_seq++;
+    if (trace_finished)
+        return;
+
+    if (trace_wait > 0)
+        trace_wait--;
+
+    while (trace_wait == 0 && !trace_finished) {
+        if (trace_pos >= sizeof(trace_data)) { // the last record was TRACE_SETTLE_MS ago
+            trace_finished = true;
+            break;
+        }
+
+        code = trace_data[trace_pos++];
+        if ((code >> 4) == EVENT_KEY)
+            push_event(EVENT_KEY, code & 0x0F);
+        else if ((code >> 4) != TRACE_GAP)
+            button_edge(code >> 4);
+
+        trace_wait = trace_next_delta();
+    }
+#endif
+}
+
+void uart_start() {
+    UART_TX_ON(TRACE_UBRR);
+}
+
+void uart_stop() {
+    while (!UART_TX_READY());
+    delay_ms(2); // the last byte is still going out of the shift register
+    UART_TX_OFF(); // D.1 goes back to the digit address
+}
+
+void uart_putchar(char c) {
+    while (!UART_TX_READY());
+    UART_DATA = c;
+}
+
+void uart_puts(char *str) {
+    while (*str)
+        uart_putchar(*str++);
+}
+
+void uart_hex(unsigned char value) {
+    char hex[] = "0123456789ABCDEF";
+
+    uart_putchar(hex[value >> 4]);
+    uart_putchar(hex[value & 0x0F]);
+}
+#endif
+
+#ifdef TRACE_RECORD
+void trace_put(unsigned char type, signed char key) {
+    // isr only, they don't nest
+    unsigned char size = trace_gap < 0x80 ? 2 : 3;
+
+    trace_seq++;
+    if (trace_len + size > TRACE_SIZE) {
+        trace_dropped++;
+        trace_seq++;
+        return;
+    }
+
+    if (size == 3)
+        trace_buf[trace_len++] = 0x80 | (trace_gap >> 8);
+    trace_buf[trace_len++] = trace_gap & 0xFF;
+    trace_buf[trace_len++] = (type << 4) | (key & 0x0F);
+    trace_gap = 0;
+    trace_seq++;
+}
+
+void trace_dump() {
+    // "trace" lines of hex bytes, for tools/trace.py. the isrs only append past the length
+    // read here, so the bytes sent don't change under us
+    unsigned int i;
+    unsigned int len;
+    unsigned int dropped;
+    unsigned char seq;
+    char lcd_output[17];
+
+    do {
+        seq = trace_seq;
+        MEMORY_BARRIER();
+        len = trace_len;
+        dropped = trace_dropped;
+        MEMORY_BARRIER();
+    } while ((seq & 1) || seq != trace_seq); // a record came in between
+
+    lcd_clear();
+    lcd_puts("Sending trace");
+
+    uart_start();
+    for (i = 0; i < len; i++) {
+        if (i % 16 == 0)
+            uart_puts(i == 0 ? "trace" : "\r\ntrace");
+        uart_putchar(' ');
+        uart_hex(trace_buf[i]);
+        WDR(); // 1s for a full buffer
+    }
+    sprintf(lcd_output, "%u", dropped);
+    uart_puts("\r\ntrace end ");
+    uart_puts(lcd_output);
+    uart_puts("\r\n");
+    uart_stop();
+
+    hold_display(1000);
+}
+#endif
+
+#ifdef TRACE_REPLAY
+unsigned int trace_next_delta() {
+    // ms to the record at trace_pos, TRACE_SETTLE_MS after the last one
+    unsigned int delta;
+
+    if (trace_pos >= sizeof(trace_data))
+        return TRACE_SETTLE_MS;
+
+    delta = trace_data[trace_pos++];
+    if (delta & 0x80)
+        delta = ((delta & 0x7F) << 8) | trace_data[trace_pos++];
+
+    return delta;
+}
+
+void trace_task() {
+    if (trace_finished && !trace_reported && !menu_open) {
+        trace_reported = true;
+        trace_report();
+    }
+}
+
+void trace_report() {
+    // the lines tools/trace.py diffs against a golden run. busy is the cpu cycles spent out
+    // of idle sleep since the start, to 64 cycles (a timer2 count)
+    struct ClockSnapshot snap;
+    char line[48];
+    unsigned char i;
+    unsigned char seq;
+    unsigned long ms;
+    unsigned long busy;
+
+    clock_snapshot(&snap);
+
+    do {
+        seq = trace_seq;
+        MEMORY_BARRIER();
+        ms = trace_ms;
+        MEMORY_BARRIER();
+    } while ((seq & 1) || seq != trace_seq);
+    busy = (ms * TIMER2_COUNTS_PER_MS - power_stats.idle_ms * TIMER2_COUNTS_PER_MS - power_stats.idle_counts) * 64;
+
+    uart_start();
+    if (trace_data[0] != 'T' || trace_data[1] != TRACE_VERSION)
+        uart_puts("replay bad trace\r\n");
+
+    for (i = 0; i < 2; i++) {
+        uart_puts("replay lcd |");
+        uart_puts(trace_lcd[i]);
+        uart_puts("|\r\n");
+    }
+
+    uart_puts("replay sevens");
+    for (i = 0; i < 6; i++) {
+        uart_putchar(' ');
+        uart_hex(trace_sevens[i]);
+    }
+    sprintf(line, " leds %d\r\n", led_code);
+    uart_puts(line);
+
+    sprintf(line, "replay time %d%d:%d%d:%d%d %d/%d/%d\r\n", snap.time.hour[0], snap.time.hour[1],
+            snap.time.min[0], snap.time.min[1], snap.time.sec[0], snap.time.sec[1],
+            snap.date.year, snap.date.month, snap.date.day);
+    uart_puts(line);
+    sprintf(line, "replay alarm %d%d:%d%d %d buzz %d\r\n", snap.alarm_time.hour[0], snap.alarm_time.hour[1],
+            snap.alarm_time.min[0], snap.alarm_time.min[1], alarm.on, snap.alarm_buzz);
+    uart_puts(line);
+    sprintf(line, "replay temper %d %d pin %d blocked %d %d\r\n", snap.temper.min, snap.temper.max,
+            pin, snap.user_blocked, snap.user_block_time);
+    uart_puts(line);
+    sprintf(line, "replay invalid %u\r\n", trace_invalid);
+    uart_puts(line);
+    sprintf(line, "replay dropped %u\r\n", events_dropped);
+    uart_puts(line);
+    sprintf(line, "replay busy %lu\r\n", busy);
+    uart_puts(line);
+    uart_puts("replay end\r\n");
+    uart_stop();
+}
+
+// the real lcd calls, for the copies below
+#undef lcd_clear
+#undef lcd_gotoxy
+#undef lcd_putchar
+#undef lcd_puts
+
+void trace_lcd_clear() {
+    unsigned char i;
+
+    for (i = 0; i < 2; i++)
+        memset(trace_lcd[i], ' ', LCD_COLUMNS);
+    trace_lcd_x = 0;
+    trace_lcd_y = 0;
+    lcd_clear();
+}
+
+void trace_lcd_gotoxy(unsigned char x, unsigned char y) {
+    trace_lcd_x = x;
+    trace_lcd_y = y;
+    lcd_gotoxy(x, y);
+}
+
+void trace_lcd_putchar(char c) {
+    // the same steps as the driver's lcd_putchar(): '\n' and the end of a line go to the
+    // start of lcd_y + 1. lines 2 and 3 (y & 3) address the dd ram past the 2 lines shown
+    if (c == '\n' || trace_lcd_x >= LCD_COLUMNS) {
+        trace_lcd_x = 0;
+        trace_lcd_y++;
+    }
+    if (c != '\n') {
+        if ((trace_lcd_y & 3) < 2)
+            trace_lcd[trace_lcd_y & 3][trace_lcd_x] = c;
+        trace_lcd_x++;
+    }
+    lcd_putchar(c);
+}
+
+void trace_lcd_puts(char *str) {
+    while (*str)
+        trace_lcd_putchar(*str++);
+}
+#endif
+
+
+void main(void) {
+    init();
+    // Global enable interrupts
+    
+    SEI();
+
+    while (1) {
+        scheduler_run();
     }
 }
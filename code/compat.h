@@ -0,0 +1,86 @@
+// toolchain differences: the code is written in CodeVision's dialect, with avr-gcc
+// (see the Makefile) the same source builds through the macros below.
+// include it after board.h, the mcu header comes in there.
+
+#ifndef _COMPAT_INCLUDED_
+#define _COMPAT_INCLUDED_
+
+#ifdef __CODEVISIONAVR__
+
+#include <alcd.h>
+#include <delay.h>
+
+#define ISR_HANDLER(vector, name) interrupt [vector] void name(void)
+#define SEI() #asm("sei")
+#define CLI() #asm("cli")
+#define WDR() #asm("wdr")
+#define SLEEP() #asm("sleep")
+#define MEMORY_BARRIER()
+
+// the startup code clears all globals: turn that off in the project, or the warm
+// restart copy never survives a reset (its checksum then makes it a cold boot)
+#define NOINIT
+
+// eeprom variables are read and written like any other in CodeVision
+#define EE_PTR(type) eeprom type *
+#define EE_READ_BYTE(p) (*(p))
+#define EE_WRITE_BYTE(p, value) (*(p) = (value))
+#define EE_READ_DWORD(p) (*(p))
+#define EE_WRITE_DWORD(p, value) (*(p) = (value))
+
+#else // avr-gcc, avr-libc
+
+#include <avr/interrupt.h>
+#include <avr/eeprom.h>
+#include <util/delay.h>
+#include "hd44780.h" // same calls as CodeVision's alcd
+
+// ISR_HANDLER(TIM1_COMPA, timer1_isr) -> ISR(TIMER1_COMPA_vect), the name is CodeVision's only
+#define ISR_HANDLER(vector, name) ISR(vector##_vect)
+#define EXT_INT0_vect INT0_vect
+#define EXT_INT1_vect INT1_vect
+#define EXT_INT2_vect INT2_vect
+#define TIM0_OVF_vect TIMER0_OVF_vect
+#define TIM1_COMPA_vect TIMER1_COMPA_vect
+#define TIM1_CAPT_vect TIMER1_CAPT_vect
+#define ADC_INT_vect ADC_vect
+#ifdef MCU_MEGA32
+#define TIM0_COMP_vect TIMER0_COMP_vect
+#define TIM2_COMP_vect TIMER2_COMP_vect
+#else
+#define TIM0_COMP_vect TIMER0_COMPA_vect
+#define TIM2_COMP_vect TIMER2_COMPA_vect
+#define ANA_COMP_vect ANALOG_COMP_vect
+#endif
+
+#define SEI() sei()
+#define CLI() cli()
+#ifdef HOST
+// the host build (host/): the sleep is where the simulated board's time moves on
+void host_sleep(void);
+#define WDR()
+#define SLEEP() host_sleep()
+#else
+#define WDR() __asm__ __volatile__ ("wdr")
+#define SLEEP() __asm__ __volatile__ ("sleep")
+#endif
+// keeps the compiler from moving plain memory accesses across it, for the seqlock loops
+#define MEMORY_BARRIER() __asm__ __volatile__ ("" ::: "memory")
+
+#define NOINIT __attribute__((section(".noinit")))
+
+#define flash const __flash
+#define eeprom EEMEM
+#define EE_PTR(type) type *
+#define EE_READ_BYTE(p) eeprom_read_byte((const uint8_t *)(p))
+#define EE_WRITE_BYTE(p, value) eeprom_write_byte((uint8_t *)(p), (value))
+#define EE_READ_DWORD(p) eeprom_read_dword((const uint32_t *)(p))
+#define EE_WRITE_DWORD(p, value) eeprom_write_dword((uint32_t *)(p), (value))
+
+#define delay_us(us) _delay_us(us)
+#define delay_ms(ms) _delay_ms(ms)
+#define itoa(value, string) itoa((value), (string), 10)
+
+#endif
+
+#endif
@@ -0,0 +1,95 @@
+// hd44780 driver for the avr-gcc build, see hd44780.h. CodeVision uses its own alcd.
+
+#include "board.h"
+#include "compat.h"
+
+#define LCD_DATA_MASK (0x0F << LCD_D4)
+
+// dd ram address of the line starts, with 4 line displays the third and fourth lines
+// carry on from the first two
+static unsigned char lcd_base_y[4];
+static unsigned char lcd_columns;
+static unsigned char lcd_x, lcd_y;
+
+static void lcd_nibble(unsigned char rs, unsigned char nibble) {
+    // the decoder bits on the same port are changed by the display isrs, so the
+    // read-modify-write is done with the interrupts off
+    unsigned char sreg = SREG;
+
+    CLI();
+    LCD_PORT = (LCD_PORT & ~(LCD_DATA_MASK | (1<<LCD_RS))) | ((nibble & 0x0F) << LCD_D4) | (rs << LCD_RS);
+    BIT_SET(LCD_PORT, LCD_EN);
+    SREG = sreg;
+    delay_us(1);
+    CLI();
+    BIT_CLEAR(LCD_PORT, LCD_EN);
+    SREG = sreg;
+}
+
+static void lcd_write(unsigned char rs, unsigned char data) {
+    lcd_nibble(rs, data >> 4);
+    lcd_nibble(rs, data);
+    delay_us(50); // no busy flag to read, longest command but clear/home is 37us
+}
+
+static void lcd_command(unsigned char command) {
+    lcd_write(0, command);
+}
+
+void lcd_init(unsigned char columns) {
+    lcd_columns = columns;
+    lcd_base_y[0] = 0x00;
+    lcd_base_y[1] = 0x40;
+    lcd_base_y[2] = columns;
+    lcd_base_y[3] = 0x40 + columns;
+
+    LCD_DDR |= LCD_DATA_MASK | (1<<LCD_RS) | (1<<LCD_EN);
+    delay_ms(20);
+    // back to 8 bit mode whatever state it was left in, then to 4 bit
+    lcd_nibble(0, 0x03);
+    delay_ms(5);
+    lcd_nibble(0, 0x03);
+    delay_us(200);
+    lcd_nibble(0, 0x03);
+    delay_us(200);
+    lcd_nibble(0, 0x02);
+    delay_us(50);
+
+    lcd_command(0x28); // 4 bit, 2 lines, 5x8
+    lcd_command(0x0C); // display on, no cursor
+    lcd_command(0x06); // increment, no shift
+    lcd_clear();
+}
+
+void lcd_clear(void) {
+    lcd_command(0x01);
+    delay_ms(2);
+    lcd_x = 0;
+    lcd_y = 0;
+}
+
+void lcd_gotoxy(unsigned char x, unsigned char y) {
+    lcd_command(0x80 | (lcd_base_y[y & 3] + x));
+    lcd_x = x;
+    lcd_y = y;
+}
+
+void lcd_putchar(char c) {
+    // like alcd: at the end of a line the next character goes to the start of the next one
+    if (c == '\n' || lcd_x >= lcd_columns)
+        lcd_gotoxy(0, lcd_y + 1);
+    if (c == '\n')
+        return;
+    lcd_write(1, c);
+    lcd_x++;
+}
+
+void lcd_puts(char *str) {
+    while (*str)
+        lcd_putchar(*str++);
+}
+
+void lcd_write_byte(unsigned char addr, unsigned char data) {
+    lcd_command(addr);
+    lcd_write(1, data);
+}
@@ -0,0 +1,15 @@
+// hd44780 alphanumeric lcd for the avr-gcc build, 4 bit and write only (R/W tied low).
+// the calls are CodeVision's alcd ones, so the rest of the code doesn't see which one
+// it's built with. the pins are LCD_* in board.h.
+
+#ifndef _HD44780_INCLUDED_
+#define _HD44780_INCLUDED_
+
+void lcd_init(unsigned char columns);
+void lcd_clear(void);
+void lcd_gotoxy(unsigned char x, unsigned char y);
+void lcd_putchar(char c);
+void lcd_puts(char *str);
+void lcd_write_byte(unsigned char addr, unsigned char data); // character generator ram
+
+#endif
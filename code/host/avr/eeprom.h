@@ -0,0 +1,16 @@
+// eeprom for the host build: EEMEM variables stay in ram, with their initial values as the
+// erased or programmed eeprom. host/sim.c puts them back with the rest on every boot.
+
+#ifndef _HOST_EEPROM_INCLUDED_
+#define _HOST_EEPROM_INCLUDED_
+
+#include <stdint.h>
+
+#define EEMEM
+
+static inline uint8_t eeprom_read_byte(const uint8_t *p) { return *p; }
+static inline void eeprom_write_byte(uint8_t *p, uint8_t value) { *p = value; }
+static inline uint32_t eeprom_read_dword(const uint32_t *p) { return *p; }
+static inline void eeprom_write_dword(uint32_t *p, uint32_t value) { *p = value; }
+
+#endif
@@ -0,0 +1,13 @@
+// interrupts for the host build: an ISR is a plain function that host/sim.c calls, the
+// global enable is the I bit of SREG, as on the chip.
+
+#ifndef _HOST_INTERRUPT_INCLUDED_
+#define _HOST_INTERRUPT_INCLUDED_
+
+#include <avr/io.h>
+
+#define ISR(vector) void vector(void); void vector(void)
+#define sei() (SREG |= 0x80)
+#define cli() (SREG &= ~0x80)
+
+#endif
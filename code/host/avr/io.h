@@ -0,0 +1,142 @@
+// the mega32's i/o registers for the host build: plain variables, defined and driven by
+// host/sim.c. only the ones the firmware uses, with avr-libc's names and bit numbers.
+
+#ifndef _HOST_IO_INCLUDED_
+#define _HOST_IO_INCLUDED_
+
+#include <stdint.h>
+
+#define HOST_REGISTERS(X) \
+    X(PORTA) X(PORTB) X(PORTC) X(PORTD) X(DDRA) X(DDRB) X(DDRC) X(DDRD) X(PINA) X(PINB) X(PINC) X(PIND) \
+    X(SREG) X(MCUCR) X(MCUCSR) X(GICR) X(GIFR) X(TIMSK) X(TIFR) X(WDTCR) X(SFIOR) \
+    X(TCCR0) X(TCNT0) X(OCR0) X(TCCR1A) X(TCCR1B) X(TCCR2) X(TCNT2) X(OCR2) X(ASSR) \
+    X(ADMUX) X(ADCSRA) X(ACSR) X(UCSRA) X(UCSRB) X(UCSRC) X(UBRRH) X(UBRRL) X(UDR) \
+    X(TWBR) X(TWSR) X(TWCR) X(TWDR)
+#define HOST_REGISTERS16(X) X(ADCW) X(TCNT1) X(OCR1A) X(ICR1)
+
+#define HOST_REGISTER_DECLARE(name) extern volatile uint8_t name;
+#define HOST_REGISTER16_DECLARE(name) extern volatile uint16_t name;
+HOST_REGISTERS(HOST_REGISTER_DECLARE)
+HOST_REGISTERS16(HOST_REGISTER16_DECLARE)
+
+// MCUCR, MCUCSR, GICR, GIFR
+#define ISC00 0
+#define ISC01 1
+#define ISC10 2
+#define ISC11 3
+#define SM0 4
+#define SM1 5
+#define SM2 6
+#define SE 7
+#define PORF 0
+#define EXTRF 1
+#define BORF 2
+#define WDRF 3
+#define ISC2 6
+#define INT2 5
+#define INT0 6
+#define INT1 7
+#define INTF2 5
+#define INTF0 6
+#define INTF1 7
+
+// TIMSK, TIFR
+#define TOIE0 0
+#define OCIE0 1
+#define TOIE1 2
+#define OCIE1B 3
+#define OCIE1A 4
+#define TICIE1 5
+#define TOIE2 6
+#define OCIE2 7
+#define TOV0 0
+#define OCF0 1
+#define TOV1 2
+#define OCF1B 3
+#define OCF1A 4
+#define ICF1 5
+#define TOV2 6
+#define OCF2 7
+
+// WDTCR
+#define WDP0 0
+#define WDP1 1
+#define WDP2 2
+#define WDE 3
+#define WDTOE 4
+
+// timers
+#define CS00 0
+#define CS01 1
+#define CS02 2
+#define WGM01 3
+#define COM00 4
+#define COM01 5
+#define WGM00 6
+#define WGM10 0
+#define WGM11 1
+#define COM1B0 4
+#define COM1B1 5
+#define COM1A0 6
+#define COM1A1 7
+#define CS10 0
+#define CS11 1
+#define CS12 2
+#define WGM12 3
+#define WGM13 4
+#define ICES1 6
+#define ICNC1 7
+#define CS20 0
+#define CS21 1
+#define CS22 2
+#define WGM21 3
+#define COM20 4
+#define COM21 5
+#define WGM20 6
+#define AS2 3
+
+// adc and analog comparator
+#define ADPS0 0
+#define ADPS1 1
+#define ADPS2 2
+#define ADIE 3
+#define ADIF 4
+#define ADATE 5
+#define ADSC 6
+#define ADEN 7
+#define ADLAR 5
+#define REFS0 6
+#define REFS1 7
+#define ADTS0 5
+#define ADTS1 6
+#define ADTS2 7
+#define ACIS0 0
+#define ACIS1 1
+#define ACIC 2
+#define ACIE 3
+#define ACI 4
+#define ACO 5
+#define ACBG 6
+#define ACD 7
+
+// usart
+#define UDRE 5
+#define TXEN 3
+#define UCSZ0 1
+#define UCSZ1 2
+#define URSEL 7
+
+// twi
+#define TWEN 2
+#define TWSTO 4
+#define TWSTA 5
+#define TWEA 6
+#define TWINT 7
+
+// flash tables are ordinary constants here
+#define __flash
+
+// avr-libc's stdlib.h has it, glibc doesn't: host/sim.c
+char *itoa(int value, char *string, int radix);
+
+#endif
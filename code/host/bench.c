@@ -0,0 +1,36 @@
+// simulated ticks per second (make bench): the firmware on host/sim.c left to run on its
+// own for BENCH_SECONDS of clock time, without the sanitizers. it shows how much session
+// time the fuzz and check runs get through, and what a change to the tasks costs.
+//
+//   bench [seconds]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "host.h"
+
+#define BENCH_SECONDS 3600
+
+static unsigned long bench_ms;
+
+static bool bench_tick(unsigned long ms) {
+    return ms < bench_ms;
+}
+
+int main(int argc, char **argv) {
+    struct timespec start, end;
+    double wall;
+
+    bench_ms = (argc > 1 ? strtoul(argv[1], 0, 10) : BENCH_SECONDS) * 1000UL;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    host_run(bench_tick);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    wall = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+    printf("%lu ticks in %.3fs: %.0f ticks/s, %.0fx real time\n", bench_ms, wall, bench_ms / wall,
+           bench_ms / 1000.0 / wall);
+
+    return 0;
+}
@@ -0,0 +1,94 @@
+// the fuzz target without libFuzzer (make check): runs the inputs named on the command line,
+// say a crash libFuzzer saved, or else CHECK_RUNS random sessions from a seed. gcc's address
+// and undefined behaviour sanitizers do the checking, as in the fuzz build.
+//
+//   check [runs [seed]]
+//   check file...
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CHECK_RUNS 200
+#define CHECK_MAX_SIZE 256
+#define CHECK_PIN "\x01\x02\x03\x04" // the default pin, or the menus are mostly the login
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+static size_t check_session(uint8_t *data) {
+    // a random start and steps in fuzz.c's format, weighted towards keys and short pauses:
+    // uniform bytes would be half long pauses and seldom get past a menu's first screen
+    size_t size = 8 + rand() % (CHECK_MAX_SIZE - 8 - 4);
+    size_t i;
+    int r;
+
+    for (i = 0; i < 8; i++)
+        data[i] = rand();
+    while (i < size) {
+        r = rand() % 100;
+        if (r < 5) {
+            memcpy(data + i, CHECK_PIN, 4);
+            i += 4;
+            continue;
+        }
+        if (r < 55)
+            data[i] = rand() % 12; // a key
+        else if (r < 65)
+            data[i] = 0x0C + rand() % 3; // a button
+        else if (r < 67)
+            data[i] = 0x0F; // a temperature reading, the next byte is its value
+        else if (r < 95)
+            data[i] = 0x10 + rand() % 0x70; // ms
+        else
+            data[i] = 0x80 + rand() % 0x80; // s
+        i++;
+    }
+
+    return i;
+}
+
+static int check_file(const char *path) {
+    static uint8_t data[1 << 16];
+    size_t size;
+    FILE *f = fopen(path, "rb");
+
+    if (f == 0) {
+        perror(path);
+        return 1;
+    }
+    size = fread(data, 1, sizeof(data), f);
+    fclose(f);
+
+    printf("%s: %zu bytes\n", path, size);
+    LLVMFuzzerTestOneInput(data, size);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    uint8_t data[CHECK_MAX_SIZE];
+    unsigned long runs = CHECK_RUNS;
+    unsigned long seed = 1;
+    unsigned long run;
+    size_t i;
+    char *end;
+    int failed = 0;
+
+    if (argc > 1) {
+        runs = strtoul(argv[1], &end, 10);
+        if (*end != 0) { // file names
+            for (i = 1; i < (size_t)argc; i++)
+                failed |= check_file(argv[i]);
+            return failed;
+        }
+    }
+    if (argc > 2)
+        seed = strtoul(argv[2], 0, 10);
+
+    srand(seed);
+    for (run = 0; run < runs; run++)
+        LLVMFuzzerTestOneInput(data, check_session(data));
+    printf("%lu random sessions from seed %lu: ok\n", runs, seed);
+
+    return 0;
+}
@@ -0,0 +1,71 @@
+// libFuzzer target (make fuzz): an input is a start state and a session of keys, button
+// edges, temperature readings and pauses for the firmware on host/sim.c. the simulation
+// aborts on a tick that leaves an invalid time or date or min >= max, the address sanitizer
+// on a buffer overrun in the menus.
+//
+// the first FUZZ_HEADER bytes: hour, minute, second, year from 1400, month, day (each folded
+// into its range, see host_set_clock()), min temperature and the span to max. then a step
+// a byte:
+//   0x00-0x0B  a key: 0-9, '*', '#'
+//   0x0C-0x0E  a falling edge on the temperature, time/alarm or date button
+//   0x0F       the next byte x4 is the temperature channel's adc reading from now on
+//   0x10-0x7F  a pause of 1-112ms
+//   0x80-0xFF  a pause of 1-128s
+// after the last step the firmware gets FUZZ_SETTLE_MS for what's still queued.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "host.h"
+
+#define FUZZ_HEADER 8
+#define FUZZ_SETTLE_MS 2000
+#define FUZZ_MAX_MS 600000UL // 10 simulated minutes an input at most
+
+static const uint8_t *fuzz_data;
+static size_t fuzz_size;
+static size_t fuzz_pos;
+static unsigned long fuzz_due; // ms the next step is due at
+
+static bool fuzz_tick(unsigned long ms) {
+    uint8_t step;
+
+    if (ms == 0) {
+        host_set_clock(fuzz_data[0], fuzz_data[1], fuzz_data[2], fuzz_data[3], fuzz_data[4], fuzz_data[5]);
+        host_set_limits(fuzz_data[6], fuzz_data[7]);
+        fuzz_pos = FUZZ_HEADER;
+        fuzz_due = 0;
+    }
+
+    while (ms >= fuzz_due && fuzz_pos < fuzz_size) {
+        step = fuzz_data[fuzz_pos++];
+        fuzz_due = ms;
+        if (step < 0x0C)
+            host_key(step);
+        else if (step < 0x0F)
+            host_button(step - 0x0C);
+        else if (step == 0x0F) {
+            if (fuzz_pos < fuzz_size)
+                host_temper_adc(fuzz_data[fuzz_pos++] * 4);
+        }
+        else if (step < 0x80)
+            fuzz_due = ms + step - 0x0F;
+        else
+            fuzz_due = ms + (step - 0x7F) * 1000UL;
+    }
+
+    if (fuzz_pos >= fuzz_size && ms >= fuzz_due + FUZZ_SETTLE_MS)
+        return false;
+    return ms < FUZZ_MAX_MS;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    if (size < FUZZ_HEADER)
+        return 0;
+
+    fuzz_data = data;
+    fuzz_size = size;
+    host_run(fuzz_tick);
+
+    return 0;
+}
@@ -0,0 +1,26 @@
+// the firmware on the host: code.c built against the register variables of host/avr/io.h,
+// with the board around it simulated in host/sim.c. the timers, the adc and the interrupts
+// are there, the time only moves on while the firmware sleeps: one timer2 tick per sleep.
+// the Makefile's fuzz, check and bench targets build on it.
+
+#ifndef _HOST_INCLUDED_
+#define _HOST_INCLUDED_
+
+#include <stdbool.h>
+
+// called once a simulated ms, before that ms's interrupts. false ends the run
+typedef bool (*HostTick)(unsigned long ms);
+
+// a cold boot of the firmware from the same memory every time, then its main loop until
+// tick ends it. every tick has to leave a valid time and date and min < max, or it aborts
+void host_run(HostTick tick);
+
+// the inputs, from tick
+void host_key(signed char key); // as the keypad scan queues it: 0-9, KEYPAD_STAR, KEYPAD_SQUARE
+void host_button(unsigned char button); // a falling edge, 0: INT0 temperature, 1: INT1 time, 2: INT2 date
+void host_temper_adc(unsigned int value); // what the temperature channel converts to from now on
+void host_set_clock(unsigned char hour, unsigned char min, unsigned char sec,
+                    unsigned char year, unsigned char month, unsigned char day); // through publish_*
+void host_set_limits(unsigned char min, unsigned char span); // temperature, through publish_temper_limits
+
+#endif
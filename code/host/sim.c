@@ -0,0 +1,218 @@
+// the board around the firmware on the host, see host.h. code.c is built into this file, so
+// the isrs and the state are reached directly. the Makefile moves this object's .data, .bss
+// and .noinit into clock_data and clock_bss, which host_run() puts back before every boot.
+
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define main firmware_main
+#define time clock_time // libc's time() would go to it
+#include "../code.c"
+#undef main
+
+#include "host.h"
+
+#define HOST_VCC_MV 5000
+#define HOST_TEMPER_ADC 51 // 25C on the lm35 against a 5V AREF
+
+// outside clock_data and clock_bss: stays over the boots
+#define HOST_KEEP __attribute__((section("host_keep")))
+
+#define HOST_REGISTER_DEFINE(name) volatile uint8_t name;
+#define HOST_REGISTER16_DEFINE(name) volatile uint16_t name;
+HOST_REGISTERS(HOST_REGISTER_DEFINE)
+HOST_REGISTERS16(HOST_REGISTER16_DEFINE)
+
+extern unsigned char __start_clock_data[], __stop_clock_data[];
+extern unsigned char __start_clock_bss[], __stop_clock_bss[];
+static unsigned char *host_image HOST_KEEP = 0; // clock_data and clock_bss as they were before the first boot
+
+static HostTick host_tick;
+static jmp_buf host_stop;
+static unsigned long host_ms;
+static unsigned int host_timer0; // timer0 counts since the last overflow
+static unsigned int host_timer1; // timer1 counts x1000, the part below one count
+static unsigned int host_temper = HOST_TEMPER_ADC;
+
+__attribute__((no_sanitize_address))
+static void host_copy(volatile unsigned char *to, volatile unsigned char *from, unsigned long size) {
+    // byte by byte past the sanitizer: the sections hold its red zones between the globals
+    while (size--)
+        *to++ = *from++;
+}
+
+static void host_boot() {
+    unsigned long data = __stop_clock_data - __start_clock_data;
+    unsigned long bss = __stop_clock_bss - __start_clock_bss;
+
+    if (host_image == 0) {
+        host_image = malloc(data + bss);
+        host_copy(host_image, __start_clock_data, data);
+        host_copy(host_image + data, __start_clock_bss, bss);
+    }
+    else {
+        host_copy(__start_clock_data, host_image, data);
+        host_copy(__start_clock_bss, host_image + data, bss);
+    }
+
+    // the registers are all 0 now, as at reset but for these
+    MCUCSR = 1<<PORF; // a power on, a cold boot
+    UCSRA = 1<<UDRE;
+    PINB = 0xFF; // no key down on the columns
+    PIND = 0xFF; // buttons up
+}
+
+void host_run(HostTick tick) {
+    host_boot();
+    host_tick = tick;
+    if (setjmp(host_stop) == 0)
+        firmware_main(); // init(), then the scheduler for good
+}
+
+static void host_interrupt(void (*isr)(void)) {
+    // the cpu clears I for the handler and reti sets it again
+    SREG &= ~0x80;
+    isr();
+    SREG |= 0x80;
+}
+
+static unsigned int host_adc(unsigned char mux) {
+    if (mux == ADC_BANDGAP)
+        return (unsigned long)BANDGAP_MV * 1024 / HOST_VCC_MV;
+    if (mux == TEMPER_ADC_CHANNEL)
+        return host_temper;
+    return 512;
+}
+
+static void host_check() {
+    // what every tick has to leave behind
+    if (clock_valid(&time, &date) && temper.min < temper.max)
+        return;
+
+    fprintf(stderr, "host: invalid state at %lu ms: %d%d:%d%d:%d%d %d/%d/%d min %d max %d\n", host_ms,
+            time.hour[0], time.hour[1], time.min[0], time.min[1], time.sec[0], time.sec[1],
+            date.year, date.month, date.day, temper.min, temper.max);
+    abort();
+}
+
+void host_sleep(void) {
+    // wakes on the next interrupt: the adc's if a conversion runs, else the next ms's ones
+    unsigned int counts;
+    uint16_t before;
+
+    if (!(MCUCR & (1<<SE)))
+        return;
+    if (!(SREG & 0x80)) {
+        fprintf(stderr, "host: sleep with the interrupts off at %lu ms, nothing would wake it\n", host_ms);
+        abort();
+    }
+
+    if ((ADCSRA & (1<<ADEN)) && (ADCSRA & (1<<ADSC))) {
+        ADCW = host_adc(ADMUX & 0x1F);
+        ADCSRA = (ADCSRA & ~(1<<ADSC)) | (1<<ADIF);
+        if (ADCSRA & (1<<ADIE)) {
+            ADCSRA &= ~(1<<ADIF);
+            host_interrupt(ADC_vect);
+        }
+        return;
+    }
+
+    if (!host_tick(host_ms))
+        longjmp(host_stop, 1);
+
+    // timer2: the 1ms tick, CTC
+    if ((TCCR2 & 0x07) && (TIMSK & (1<<OCIE2)))
+        host_interrupt(TIMER2_COMP_vect);
+
+    // timer0: 125 counts a ms, the digit's on time ends on the compare, the overflow isr
+    // reloads TCNT0 with TIMER0_START for the next one
+    if (TCCR0 & 0x07) {
+        host_timer0 += 125;
+        if (host_timer0 >= 256 - TIMER0_START) {
+            host_timer0 -= 256 - TIMER0_START;
+            if (TIMSK & (1<<OCIE0))
+                host_interrupt(TIMER0_COMP_vect);
+            if (TIMSK & (1<<TOIE0))
+                host_interrupt(TIMER0_OVF_vect);
+        }
+    }
+
+    // timer1: TIMER1_HZ, free running, the second ends when it passes OCR1A
+    if (TCCR1B & 0x07) {
+        host_timer1 += TIMER1_HZ;
+        counts = host_timer1 / 1000;
+        host_timer1 %= 1000;
+        before = TCNT1;
+        TCNT1 = before + counts;
+        if ((uint16_t)(OCR1A - before - 1) < counts && (TIMSK & (1<<OCIE1A)))
+            host_interrupt(TIMER1_COMPA_vect);
+    }
+
+    host_check();
+    host_ms++;
+}
+
+void host_key(signed char key) {
+    SREG &= ~0x80; // from the timer2 isr on the chip
+    push_event(EVENT_KEY, key);
+    SREG |= 0x80;
+}
+
+void host_button(unsigned char button) {
+    if (!(GICR & (1<<(button == 0 ? INT0 : button == 1 ? INT1 : INT2))))
+        return;
+    host_interrupt(button == 0 ? INT0_vect : button == 1 ? INT1_vect : INT2_vect);
+}
+
+void host_temper_adc(unsigned int value) {
+    host_temper = value;
+}
+
+void host_set_clock(unsigned char hour, unsigned char min, unsigned char sec,
+                    unsigned char year, unsigned char month, unsigned char day) {
+    // any bytes: each one is folded into its range
+    struct Time t;
+    struct Date d;
+
+    hour %= 24;
+    min %= 60;
+    sec %= 60;
+    t.hour[0] = hour / 10;
+    t.hour[1] = hour % 10;
+    t.min[0] = min / 10;
+    t.min[1] = min % 10;
+    t.sec[0] = sec / 10;
+    t.sec[1] = sec % 10;
+    d.year = SNAPSHOT_YEAR_BASE + year % (YEAR_MAX - SNAPSHOT_YEAR_BASE + 1);
+    d.month = 1 + month % 12;
+    d.day = 1 + day % jalali_month_days(d.year, d.month);
+
+    publish_time(&t);
+    publish_date(&d);
+}
+
+void host_set_limits(unsigned char min, unsigned char span) {
+    // what set_temper_int() lets through: 0 <= min < max <= 100
+    min %= 100;
+    publish_temper_limits(min, min + 1 + span % (100 - min));
+}
+
+char *(itoa)(int value, char *string, int radix) {
+    char digits[sizeof(int) * 8];
+    unsigned int u = value < 0 && radix == 10 ? -(unsigned int)value : (unsigned int)value;
+    unsigned char n = 0;
+    char *p = string;
+
+    if (value < 0 && radix == 10)
+        *p++ = '-';
+    do {
+        digits[n++] = "0123456789abcdefghijklmnopqrstuvwxyz"[u % radix];
+        u /= radix;
+    } while (u);
+    while (n)
+        *p++ = digits[--n];
+    *p = 0;
+
+    return string;
+}
@@ -0,0 +1,10 @@
+// busy waits for the host build: the simulated time only moves while the firmware sleeps,
+// so they take none.
+
+#ifndef _HOST_DELAY_INCLUDED_
+#define _HOST_DELAY_INCLUDED_
+
+#define _delay_us(us) ((void)(us))
+#define _delay_ms(ms) ((void)(ms))
+
+#endif
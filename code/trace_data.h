@@ -0,0 +1,12 @@
+// recorded trace for TRACE_REPLAY, made by tools/trace.py from login_session.txt
+// start: 12:45:00 1400/3/20, alarm 13:30 off, temper 18..25, pin 1234
+//     2.000s  time button
+//     2.600s  key 1
+//     3.200s  key 2
+//     3.800s  key 3
+//     4.400s  key 4
+//     5.900s  key *
+//     7.900s  key 0
+0x54, 0x01, 0x0C, 0x2D, 0x00, 0x78, 0x05, 0x03, 0x14, 0x0D, 0x1E, 0x00, 0x12, 0x19, 0xD2, 0x04,
+0x87, 0xD0, 0x20, 0x82, 0x58, 0x01, 0x82, 0x58, 0x02, 0x82, 0x58, 0x03, 0x82, 0x58, 0x04, 0x85,
+0xDC, 0x0A, 0x87, 0xD0, 0x00,
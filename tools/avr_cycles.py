@@ -0,0 +1,76 @@
+#!/usr/bin/env python3
+"""Static cycle estimate of the interrupt handlers from an avr-objdump -d listing.
+
+    avr-objdump -d build/os/clock.elf > clock.lst
+    python3 tools/avr_cycles.py clock.lst
+
+Every instruction of a function is counted once, branches and skips as not taken and
+calls with the estimate of the function they call. Loops run once, so it's the cost of
+the path through a handler, not its worst case: good for comparing two builds or two
+profiles, the timing itself is measured on the board (or in a simulator).
+"""
+
+import re
+import sys
+
+# classic avr core with a 16 bit pc (mega32, mega644): cycles that aren't 1
+CYCLES = {
+    'adiw': 2, 'sbiw': 2, 'mul': 2, 'muls': 2, 'mulsu': 2, 'fmul': 2, 'fmuls': 2, 'fmulsu': 2,
+    'ld': 2, 'ldd': 2, 'lds': 2, 'st': 2, 'std': 2, 'sts': 2, 'push': 2, 'pop': 2,
+    'sbi': 2, 'cbi': 2, 'rjmp': 2, 'ijmp': 2, 'lpm': 3, 'elpm': 3,
+    'jmp': 3, 'rcall': 3, 'icall': 3, 'call': 4, 'ret': 4, 'reti': 4,
+}
+ISR_ENTRY = 4 + 3  # the response to the interrupt and the jmp in the vector table
+
+LABEL = re.compile(r'^([0-9a-f]+) <([^>]+)>:')
+INSN = re.compile(r'^\s+[0-9a-f]+:\s+(?:[0-9a-f]{2} )+\s*([a-z]+)\s*(.*)')
+TARGET = re.compile(r'<([^>+]+)>')
+
+
+def parse(lines):
+    functions = {}
+    body = None
+    for line in lines:
+        m = LABEL.match(line)
+        if m:
+            body = functions.setdefault(m.group(2), [])
+            continue
+        m = INSN.match(line)
+        if m and body is not None:
+            body.append((m.group(1), m.group(2)))
+    return functions
+
+
+def estimate(name, functions, memo, active=()):
+    if name in memo:
+        return memo[name]
+    if name not in functions or name in active:
+        return 0  # outside the listing, or recursion
+    total = 0
+    for op, args in functions[name]:
+        total += CYCLES.get(op, 1)
+        if op in ('call', 'rcall'):
+            t = TARGET.search(args)
+            if t:
+                total += estimate(t.group(1), functions, memo, active + (name,))
+    memo[name] = total
+    return total
+
+
+def main(argv):
+    if len(argv) != 2:
+        sys.exit(__doc__)
+    with open(argv[1]) as f:
+        functions = parse(f)
+    memo = {}
+    handlers = sorted(n for n in functions if n.startswith('__vector_') and n != '__vector_default')
+    if not handlers:
+        sys.exit('no __vector_ handlers in %s' % argv[1])
+    print('%-14s %6s %7s' % ('handler', 'insns', 'cycles'))
+    for name in handlers:
+        insns = len(functions[name])
+        print('%-14s %6d %7d' % (name, insns, ISR_ENTRY + estimate(name, functions, memo)))
+
+
+if __name__ == '__main__':
+    main(sys.argv)
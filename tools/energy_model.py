@@ -0,0 +1,328 @@
+#!/usr/bin/env python3
+"""Board current of a firmware build, from a simulated run of the clock.
+
+    energy_model.py run code/build/os/clock.elf [--wall 120] [--json os.json]
+                                        run it under simavr and report
+    energy_model.py report run.vcd      report on a trace already taken
+    energy_model.py compare old.json new.json
+                                        two builds side by side
+    energy_model.py model > board.json  the default current model, to edit
+
+simavr traces the writes to PORTA, PORTC, PORTD, ADCSRA and the sleep control
+register into a vcd file. The pins are read as board.h has them: the segments on
+PORTA, the 7 segment enable on C.7, the digit selects on D.4/D.5, the buzzer on D.6
+and the relay on D.7. The cpu is asleep while SE is set, the firmware only sets it
+around the sleep instruction, and the sleep mode bits say which sleep. Each write
+that sets ADSC is one conversion of ADC current.
+
+The interrupt handlers that wake the cpu from idle run before the firmware clears
+SE again, so their time (the 1ms tick, the digit multiplexing) is billed as idle,
+not active. The cpu current is low by that much, and that is the part most likely
+to differ between builds: compare the cycle estimates of `make report` for it.
+
+Each state is held until the next change and weighted by its time, with the
+currents from the model (--model board.json, any keys left out keep the
+defaults). A run covers as many simulated seconds as simavr gets through in
+--wall seconds. The result is scaled to mAh per day. Set --wall higher for a
+whole simulated day, or leave it short to compare builds.
+
+The model's defaults are typical datasheet figures, not measurements. Measure a
+board once and put its numbers in a model file. After that the runs compare builds
+on battery life, the same way `make report` compares them on cycles.
+"""
+
+import argparse
+import json
+import os
+import re
+import signal
+import subprocess
+import sys
+import tempfile
+import time
+
+# mA at 5V and 8MHz
+MODEL = {
+    'cpu_active': 11.0,
+    'cpu_idle': 5.0,  # SLEEP_IDLE, the timers and the usart still clocked
+    'cpu_adc_noise': 1.5,  # the conversion itself is under 'adc'
+    'adc': 0.3,  # while converting
+    'adc_conversion_us': 26,  # 13 adc clocks at 500kHz
+    'segment': 9.0,  # one lit segment: (5V - 2V) / 330R
+    'led': 10.0,  # one of the band leds is always lit once the latch has been written
+    'buzzer': 25.0,
+    'relay': 70.0,  # the coil, through its driver
+    'lcd': 1.2,  # the controller
+    'backlight': 20.0,
+    'board': 5.0,  # the regulator's own current and the pull-ups
+}
+
+# register data addresses and the sleep control bits, per part
+MCUS = {
+    'atmega32': {'porta': 0x3B, 'portc': 0x35, 'portd': 0x32, 'adcsra': 0x26, 'sleep': 0x55,
+                 'se': 7, 'sm_shift': 4},
+    'atmega644p': {'porta': 0x22, 'portc': 0x28, 'portd': 0x2B, 'adcsra': 0x7A, 'sleep': 0x53,
+                   'se': 0, 'sm_shift': 1},
+}
+MCUS['atmega644'] = MCUS['atmega644pa'] = MCUS['atmega644p']
+
+# board.h
+SEGMENTS = 0x7F
+SEVENS_ENABLE = 7  # C.7, low: on
+DIGITS = (1 << 4) | (1 << 5)  # D.4, D.5
+BUZZER = 6
+RELAY = 7
+LEDS_LATCH = 6  # C.6
+
+SLEEP_IDLE = 0
+SLEEP_ADC_NOISE = 1
+ADSC = 6
+
+SUBSYSTEMS = ['cpu', 'adc', '7seg', 'leds', 'buzzer', 'relay', 'lcd', 'board']
+SECONDS_PER_DAY = 86400
+
+
+def read_vcd(path):
+    """The changes of the traced registers: [(seconds, register, value)], in time order.
+
+    A register comes as one 8 bit signal ("porta") or as one signal per bit
+    ("porta_3"), depending on the simavr version."""
+    names = {}  # vcd id -> (register, bit or None)
+    scale = 1e-9
+    changes = []
+    now = 0.0
+    values = {}
+
+    def value_of(text):
+        try:
+            return int(text.replace('x', '0').replace('z', '0'), 2)
+        except ValueError:
+            return 0
+
+    def set_value(ident, bits):
+        register, bit = names[ident]
+        if bit is None:
+            value = bits
+        else:
+            old = values.get(register, 0)
+            value = (old | (1 << bit)) if bits else (old & ~(1 << bit))
+        values[register] = value
+        changes.append((now, register, value))
+
+    with open(path) as f:
+        text = f.read()
+
+    header, _, body = text.partition('$enddefinitions')
+    match = re.search(r'\$timescale\s*(\d+)\s*([munpf]?s)\s*\$end', header)
+    if match:
+        units = {'s': 1, 'ms': 1e-3, 'us': 1e-6, 'ns': 1e-9, 'ps': 1e-12, 'fs': 1e-15}
+        scale = int(match.group(1)) * units[match.group(2)]
+    for match in re.finditer(r'\$var\s+\S+\s+\d+\s+(\S+)\s+(\S+)(?:\s+\[[^\]]*\])?\s+\$end', header):
+        ident, name = match.groups()
+        wanted = re.match(r'^(porta|portc|portd|adcsra|sleep)(?:_?(\d))?$', name.lower())
+        if wanted:
+            bit = wanted.group(2)
+            names[ident] = (wanted.group(1), int(bit) if bit is not None else None)
+    if not names:
+        sys.exit('%s: none of porta, portc, portd, adcsra or sleep is traced in it' % path)
+
+    words = iter(body.split()[1:])  # after "$end"
+    for word in words:
+        if word.startswith('#'):
+            now = int(word[1:]) * scale
+        elif word[0] in 'bBrR':
+            ident = next(words, '')
+            if ident in names:
+                set_value(ident, value_of(word[1:]))
+        elif word[0] in '01xzXZ' and len(word) > 1:
+            if word[1:] in names:
+                set_value(word[1:], 1 if word[0] == '1' else 0)
+        # $dumpvars, $end and the like carry nothing of their own
+
+    return changes
+
+
+def integrate(changes, mcu, model):
+    """mA seconds per subsystem, the cpu's time per state, and the seconds covered."""
+    regs = {'porta': 0, 'portc': 1 << SEVENS_ENABLE, 'portd': 0, 'adcsra': 0, 'sleep': 0}
+    charge = dict.fromkeys(SUBSYSTEMS, 0.0)
+    cpu_time = {'active': 0.0, 'idle': 0.0, 'adc_noise': 0.0}
+    leds_latched = False
+    last = changes[0][0] if changes else 0.0
+    start = last
+
+    def hold(seconds):
+        sleeping = regs['sleep'] & (1 << mcu['se'])
+        mode = (regs['sleep'] >> mcu['sm_shift']) & 0x07
+        if not sleeping:
+            state = 'active'
+        elif mode == SLEEP_ADC_NOISE:
+            state = 'adc_noise'
+        else:
+            state = 'idle'
+        cpu_time[state] += seconds
+        charge['cpu'] += model['cpu_' + state] * seconds
+        if state == 'adc_noise':
+            charge['adc'] += model['adc'] * seconds
+
+        if not regs['portc'] & (1 << SEVENS_ENABLE) and regs['portd'] & DIGITS:
+            charge['7seg'] += bin(regs['porta'] & SEGMENTS).count('1') * model['segment'] * seconds
+        if leds_latched:
+            charge['leds'] += model['led'] * seconds
+        if regs['portd'] & (1 << BUZZER):
+            charge['buzzer'] += model['buzzer'] * seconds
+        if regs['portd'] & (1 << RELAY):
+            charge['relay'] += model['relay'] * seconds
+        charge['lcd'] += (model['lcd'] + model['backlight']) * seconds
+        charge['board'] += model['board'] * seconds
+
+    for when, register, value in changes:
+        if when > last:
+            hold(when - last)
+            last = when
+        if register == 'adcsra' and value & ~regs['adcsra'] & (1 << ADSC):
+            charge['adc'] += model['adc'] * model['adc_conversion_us'] * 1e-6
+        if register == 'portc' and regs['portc'] & ~value & (1 << LEDS_LATCH):
+            leds_latched = True
+        regs[register] = value
+
+    return charge, cpu_time, last - start
+
+
+def summary(charge, cpu_time, seconds):
+    if seconds <= 0:
+        sys.exit('the trace covers no time')
+    return {
+        'seconds': seconds,
+        'mA': {name: charge[name] / seconds for name in SUBSYSTEMS},
+        'cpu': {state: cpu_time[state] / seconds for state in cpu_time},
+    }
+
+
+def print_summary(result, battery):
+    total = sum(result['mA'].values())
+    print('%.1f simulated seconds, scaled to a day' % result['seconds'])
+    print('%-8s %8s %10s %6s' % ('', 'mA', 'mAh/day', ''))
+    for name in SUBSYSTEMS:
+        current = result['mA'][name]
+        print('%-8s %8.2f %10.1f %5.1f%%' % (name, current, current * 24, 100 * current / total if total else 0))
+    print('%-8s %8.2f %10.1f' % ('total', total, total * 24))
+    print('cpu: %s' % ', '.join('%s %.1f%%' % (state, 100 * share) for state, share in result['cpu'].items()))
+    if battery and total:
+        print('%d mAh battery: %.1f days' % (battery, battery / (total * 24)))
+
+
+def load_model(path):
+    model = dict(MODEL)
+    if path:
+        with open(path) as f:
+            extra = json.load(f)
+        unknown = set(extra) - set(MODEL)
+        if unknown:
+            sys.exit('%s: not in the model: %s' % (path, ', '.join(sorted(unknown))))
+        model.update(extra)
+    return model
+
+
+def run_simavr(args, vcd):
+    mcu = MCUS[args.mcu]
+    command = [args.simavr, '-m', args.mcu, '-f', str(args.freq), '-o', vcd]
+    for register in ('porta', 'portc', 'portd', 'adcsra', 'sleep'):
+        command += ['-at', '%s=trace@0x%02x/0xff' % (register, mcu[register])]
+    command.append(args.elf)
+
+    try:
+        sim = subprocess.Popen(command, stdout=subprocess.DEVNULL, stderr=subprocess.PIPE)
+    except OSError as e:
+        sys.exit('%s: %s (set --simavr to the run_avr binary)' % (args.simavr, e))
+    deadline = time.time() + args.wall
+    while time.time() < deadline and sim.poll() is None:
+        time.sleep(0.2)
+    if sim.poll() is None:
+        sim.send_signal(signal.SIGINT)  # simavr closes the vcd file on it
+        try:
+            sim.wait(10)
+        except subprocess.TimeoutExpired:
+            sim.kill()
+            sim.wait()
+    else:
+        print('simavr stopped by itself (%d): %s' % (sim.returncode, sim.stderr.read().decode(errors='replace').strip()),
+              file=sys.stderr)
+
+
+def compare(old_path, new_path):
+    with open(old_path) as f:
+        old = json.load(f)
+    with open(new_path) as f:
+        new = json.load(f)
+    print('%-8s %10s %10s %9s' % ('mAh/day', os.path.basename(old_path), os.path.basename(new_path), 'change'))
+    for name in SUBSYSTEMS + ['total']:
+        if name == 'total':
+            a, b = sum(old['mA'].values()) * 24, sum(new['mA'].values()) * 24
+        else:
+            a, b = old['mA'][name] * 24, new['mA'][name] * 24
+        change = '%+.1f%%' % (100 * (b - a) / a) if a else ''
+        print('%-8s %10.1f %10.1f %9s' % (name, a, b, change))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    commands = parser.add_subparsers(dest='command')
+
+    def common(sub):
+        sub.add_argument('--mcu', default='atmega32', choices=sorted(MCUS))
+        sub.add_argument('--model', help='json file with the currents that differ from the defaults')
+        sub.add_argument('--json', help='write the result here, for compare')
+        sub.add_argument('--battery', type=int, help='battery capacity in mAh, for the days it lasts')
+
+    run = commands.add_parser('run', help='simulate the firmware and report')
+    run.add_argument('elf')
+    run.add_argument('--freq', type=int, default=8000000)
+    run.add_argument('--wall', type=float, default=120, help='seconds simavr gets to run')
+    run.add_argument('--simavr', default='simavr')
+    run.add_argument('--vcd', help='keep the trace here')
+    common(run)
+
+    report = commands.add_parser('report', help='report on a vcd trace')
+    report.add_argument('vcd')
+    common(report)
+
+    both = commands.add_parser('compare', help='two results written with --json')
+    both.add_argument('old')
+    both.add_argument('new')
+
+    commands.add_parser('model', help='print the default model')
+
+    args = parser.parse_args()
+    if args.command == 'compare':
+        compare(args.old, args.new)
+        return
+    if args.command == 'model':
+        print(json.dumps(MODEL, indent=4))
+        return
+    if args.command not in ('run', 'report'):
+        parser.print_help()
+        sys.exit(1)
+
+    model = load_model(args.model)
+    vcd = args.vcd
+    if args.command == 'run':
+        if not vcd:
+            handle, vcd = tempfile.mkstemp(suffix='.vcd')
+            os.close(handle)
+        run_simavr(args, vcd)
+    try:
+        changes = read_vcd(vcd)
+    finally:
+        if args.command == 'run' and not args.vcd:
+            os.remove(vcd)
+
+    result = summary(*integrate(changes, MCUS[args.mcu], model))
+    print_summary(result, args.battery)
+    if args.json:
+        with open(args.json, 'w') as f:
+            json.dump(result, f, indent=4)
+
+
+if __name__ == '__main__':
+    main()
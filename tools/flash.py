@@ -0,0 +1,160 @@
+#!/usr/bin/env python3
+"""Load the clock's firmware through the serial bootloader (code/bootloader).
+
+    python3 tools/flash.py /dev/ttyUSB0 code/build/os/clock.hex [--baud 38400]
+
+Hold the time/alarm button while resetting the clock, or flash a board whose last
+image never verified: the bootloader only answers then. Needs pyserial.
+
+Blocks go out two at a time with a crc each; the bootloader acknowledges a block
+before programming it, so the flash writes overlap the transfer. A rejected block is
+sent again, with the ones after it. At the end the whole image is checked against
+its crc before the bootloader marks it good and starts it.
+"""
+
+import argparse
+import sys
+import time
+
+WINDOW = 2  # blocks in flight, the bootloader buffers two
+RETRIES = 5
+
+
+def crc16_xmodem(data, crc=0):
+    for byte in data:
+        crc ^= byte << 8
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x1021) if crc & 0x8000 else crc << 1
+            crc &= 0xFFFF
+    return crc
+
+
+def read_hex(path):
+    image = bytearray()
+    base = 0
+    with open(path) as f:
+        for number, line in enumerate(f, 1):
+            line = line.strip()
+            if not line:
+                continue
+            if not line.startswith(':'):
+                sys.exit('%s:%d: not an intel hex record' % (path, number))
+            record = bytes.fromhex(line[1:])
+            if sum(record) & 0xFF:
+                sys.exit('%s:%d: bad checksum' % (path, number))
+            count, address, kind = record[0], (record[1] << 8) | record[2], record[3]
+            data = record[4:4 + count]
+            if kind == 0:
+                start = base + address
+                if len(image) < start + count:
+                    image.extend(b'\xff' * (start + count - len(image)))
+                image[start:start + count] = data
+            elif kind == 1:
+                break
+            elif kind == 2:
+                base = ((data[0] << 8) | data[1]) << 4
+            elif kind == 4:
+                base = ((data[0] << 8) | data[1]) << 16
+    return image
+
+
+def le16(value):
+    return bytes((value & 0xFF, value >> 8))
+
+
+class Bootloader:
+    def __init__(self, port):
+        self.port = port
+
+    def read(self, count, what):
+        data = self.port.read(count)
+        if len(data) != count:
+            sys.exit('no answer from the bootloader (%s)' % what)
+        return data
+
+    def connect(self, seconds):
+        # asks until it answers, the user may still be pressing reset
+        deadline = time.time() + seconds
+        while time.time() < deadline:
+            self.port.reset_input_buffer()
+            self.port.write(b'I')
+            reply = self.port.read(6)
+            if len(reply) == 6 and reply[0:1] == b'I':
+                return reply[1], reply[2] | (reply[3] << 8), reply[4] | (reply[5] << 8)
+        sys.exit('no bootloader on %s: hold the time/alarm button and reset the clock' % self.port.name)
+
+    def block(self, page, data):
+        body = le16(page) + bytes(data)
+        self.port.write(b'W' + body + le16(crc16_xmodem(body)))
+
+    def write(self, image, page_size):
+        pages = (len(image) + page_size - 1) // page_size
+        image = image + b'\xff' * (pages * page_size - len(image))
+        sent = 0  # next page to send
+        acked = 0  # pages before this one are programmed
+        retries = 0
+        while acked < pages:
+            while sent < pages and sent - acked < WINDOW:
+                self.block(sent, image[sent * page_size:(sent + 1) * page_size])
+                sent += 1
+            reply = self.port.read(3)
+            if len(reply) == 3 and reply[0:1] == b'K' and (reply[1] | (reply[2] << 8)) == acked:
+                acked += 1
+                retries = 0
+                print('\r%d/%d blocks' % (acked, pages), end='', flush=True)
+                continue
+            # rejected or out of step: let the line go quiet, then go again from the first
+            # block not acknowledged
+            retries += 1
+            if retries > RETRIES:
+                sys.exit('\nblock %d failed %d times' % (acked, RETRIES))
+            if len(reply) < 3:
+                # a byte got lost and the bootloader still waits for the end of a block:
+                # fill it up, the crc fails and it answers 'N'
+                self.port.write(b'\xff' * (page_size + 5))
+            time.sleep(0.15)
+            self.port.reset_input_buffer()
+            sent = acked
+        print()
+
+    def verify(self, image):
+        self.port.write(b'V' + le16(len(image)) + le16(crc16_xmodem(image)))
+        return self.read(1, 'verify') == b'K'
+
+    def start(self):
+        self.port.write(b'G')
+        return self.read(1, 'start') == b'K'
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('port')
+    parser.add_argument('hex')
+    parser.add_argument('--baud', type=int, default=38400)
+    parser.add_argument('--wait', type=float, default=30, help='seconds to wait for the bootloader')
+    args = parser.parse_args()
+
+    try:
+        import serial
+    except ImportError:
+        sys.exit('pyserial is needed: pip install pyserial')
+
+    image = read_hex(args.hex)
+    with serial.Serial(args.port, args.baud, timeout=1) as port:
+        boot = Bootloader(port)
+        version, page_size, app_end = boot.connect(args.wait)
+        print('bootloader %d: %d byte blocks, %d bytes for the application' % (version, page_size, app_end))
+        if len(image) > app_end:
+            sys.exit('%s is %d bytes, it runs into the bootloader' % (args.hex, len(image)))
+
+        started = time.time()
+        boot.write(image, page_size)
+        if not boot.verify(image):
+            sys.exit('the image in flash doesn\'t match, the bootloader stays in')
+        print('%d bytes in %.1fs, verified' % (len(image), time.time() - started))
+        if not boot.start():
+            sys.exit('the bootloader didn\'t start the clock')
+
+
+if __name__ == '__main__':
+    main()
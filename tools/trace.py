@@ -0,0 +1,188 @@
+#!/usr/bin/env python3
+"""Input traces of the clock, see TRACE_RECORD / TRACE_REPLAY in code/board.h.
+
+    trace.py show capture.txt           the recorded events, one per line
+    trace.py header capture.txt > code/trace_data.h
+                                        the trace for a TRACE_REPLAY build
+    trace.py diff golden.txt new.txt    compare two replay reports
+    trace.py random SEED [EVENTS] > code/trace_data.h
+                                        a random session, for shaking out input bugs
+
+capture.txt is what a TRACE_RECORD board sends on key 3 ("trace ..." lines), the
+reports are what a TRACE_REPLAY build sends when the trace has run out ("replay ..."
+lines). Other lines in the files are skipped, so a whole terminal log will do.
+diff exits with 1 when the screens or the state differ; the busy cycles are only
+reported, they move with any change to the code.
+
+A random session mixes key presses, button edges (some of them bounces closer than
+the lockout) and long pauses; the report's "invalid" line counts the seconds that
+ended with a bad time or date or min >= max. The same seed gives the same trace.
+"""
+
+import random
+import sys
+
+VERSION = 1
+HEADER_SIZE = 16
+GAP = 15
+EVENTS = {0: 'key', 1: 'temper button', 2: 'time button', 3: 'date button', GAP: 'gap'}
+KEYS = {10: '*', 11: '#'}
+
+
+def read_capture(path):
+    data = []
+    dropped = None
+    with open(path, errors='replace') as f:
+        for line in f:
+            words = line.split()
+            if not words or words[0] != 'trace':
+                continue
+            if len(words) > 1 and words[1] == 'end':
+                dropped = int(words[2]) if len(words) > 2 else 0
+                continue
+            data.extend(int(w, 16) for w in words[1:])
+    if len(data) < HEADER_SIZE or data[0] != ord('T'):
+        sys.exit('%s: no trace in it' % path)
+    if data[1] != VERSION:
+        sys.exit('%s: trace version %d, this reads %d' % (path, data[1], VERSION))
+    if dropped is None:
+        print('warning: %s has no "trace end" line, it may be cut short' % path, file=sys.stderr)
+    elif dropped:
+        print('warning: the recording was full, %d records are missing at the end' % dropped,
+              file=sys.stderr)
+    return data
+
+
+def records(data):
+    # (ms from the start, type, key)
+    pos = HEADER_SIZE
+    now = 0
+    while pos < len(data):
+        delta = data[pos]
+        pos += 1
+        if delta & 0x80:
+            delta = ((delta & 0x7F) << 8) | data[pos]
+            pos += 1
+        code = data[pos]
+        pos += 1
+        now += delta
+        yield now, code >> 4, code & 0x0F
+
+
+def describe_header(data):
+    year = data[5] | (data[6] << 8)
+    pin = data[14] | (data[15] << 8)
+    return ('%02d:%02d:%02d %d/%d/%d, alarm %02d:%02d %s, temper %d..%d, pin %d' %
+            (data[2], data[3], data[4], year, data[7], data[8], data[9], data[10],
+             'on' if data[11] else 'off', signed(data[12]), signed(data[13]), pin))
+
+
+def describe(kind, key):
+    if kind == 0:
+        return 'key %s' % KEYS.get(key, key)
+    return EVENTS.get(kind, 'unknown %d' % kind)
+
+
+def signed(byte):
+    return byte - 256 if byte > 127 else byte
+
+
+def show(path):
+    data = read_capture(path)
+    print('start:', describe_header(data))
+    for ms, kind, key in records(data):
+        if kind != GAP:
+            print('%9.3fs  %s' % (ms / 1000.0, describe(kind, key)))
+
+
+def header(path):
+    write_header(read_capture(path), path)
+
+
+def random_trace(seed, count):
+    rng = random.Random(seed)
+    year = rng.randint(1400, 1410)
+    data = [ord('T'), VERSION, rng.randint(0, 23), rng.randint(0, 59), rng.randint(0, 59),
+            year & 0xFF, year >> 8, rng.randint(1, 12), rng.randint(1, 29),
+            rng.randint(0, 23), rng.randint(0, 59), rng.randint(0, 1), 18, 25, 0xD2, 0x04]
+    for _ in range(count):
+        pick = rng.random()
+        if pick < 0.75:
+            kind, key = 0, rng.choice(range(12))
+            delta = rng.randint(30, 900)
+        elif pick < 0.95:
+            kind, key = rng.randint(1, 3), 0
+            delta = rng.choice((rng.randint(0, 40), rng.randint(200, 3000)))
+        else:
+            kind, key = 0, rng.choice(range(12))
+            delta = rng.randint(5000, 32767)  # long enough for the block and the menus to time out
+        if delta < 0x80:
+            data.append(delta)
+        else:
+            data.extend((0x80 | (delta >> 8), delta & 0xFF))
+        data.append((kind << 4) | key)
+    return data
+
+
+def write_header(data, source):
+    print('// recorded trace for TRACE_REPLAY, made by tools/trace.py from %s' % source)
+    print('// start: %s' % describe_header(data))
+    for ms, kind, key in records(data):
+        if kind != GAP:
+            print('// %9.3fs  %s' % (ms / 1000.0, describe(kind, key)))
+    for i in range(0, len(data), 16):
+        print(', '.join('0x%02X' % b for b in data[i:i + 16]) + ',')
+
+
+def read_report(path):
+    lines = []
+    busy = None
+    with open(path, errors='replace') as f:
+        for line in f:
+            line = line.rstrip('\r\n')
+            if not line.startswith('replay '):
+                continue
+            if line.startswith('replay busy '):
+                busy = int(line.split()[2])
+            elif line != 'replay end':
+                lines.append(line[len('replay '):])
+    if not lines:
+        sys.exit('%s: no replay report in it' % path)
+    return lines, busy
+
+
+def diff(golden_path, new_path):
+    golden, golden_busy = read_report(golden_path)
+    new, new_busy = read_report(new_path)
+    same = True
+    for i in range(max(len(golden), len(new))):
+        a = golden[i] if i < len(golden) else '(missing)'
+        b = new[i] if i < len(new) else '(missing)'
+        if a != b:
+            same = False
+            print('- %s' % a)
+            print('+ %s' % b)
+    if golden_busy is not None and new_busy is not None:
+        change = new_busy - golden_busy
+        print('busy cycles: %d -> %d (%+d, %+.1f%%)' %
+              (golden_busy, new_busy, change, 100.0 * change / golden_busy if golden_busy else 0))
+    print('same' if same else 'different')
+    return 0 if same else 1
+
+
+def main(argv):
+    if len(argv) == 3 and argv[1] == 'show':
+        show(argv[2])
+    elif len(argv) == 3 and argv[1] == 'header':
+        header(argv[2])
+    elif len(argv) == 4 and argv[1] == 'diff':
+        sys.exit(diff(argv[2], argv[3]))
+    elif len(argv) in (3, 4) and argv[1] == 'random':
+        seed = int(argv[2])
+        write_header(random_trace(seed, int(argv[3]) if len(argv) == 4 else 200), 'seed %d' % seed)
+    else:
+        sys.exit(__doc__)
+
+
+if __name__ == '__main__':
+    main(sys.argv)